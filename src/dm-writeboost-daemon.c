@@ -21,115 +21,611 @@
 #include "dm-writeboost-metadata.h"
 #include "dm-writeboost-daemon.h"
 
-#include <linux/rbtree.h>
-
 /*----------------------------------------------------------------------------*/
 
-void queue_barrier_io(struct wb_device *wb, struct bio *bio)
+enum hrtimer_restart barrier_deadline_proc(struct hrtimer *timer)
 {
-	mutex_lock(&wb->io_lock);
-	bio_list_add(&wb->barrier_ios, bio);
-	mutex_unlock(&wb->io_lock);
+	struct wb_device *wb = container_of(timer, struct wb_device, barrier_deadline_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	wb->barrier_deadline_armed = false;
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+
+	queue_work(wb->barrier_wq, &wb->flush_barrier_work);
+	queue_work(wb->barrier_wq, &wb->flush_fua_work);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Commit the barriers (or FUA writes) in group. They are committed
+ * $barrier_deadline_us after the first one in the group arrives unless the
+ * segments they wait for are filled up and flushed earlier.
+ * Must be called with barrier_lock held after queuing the bio.
+ */
+void start_barrier_deadline(struct wb_device *wb, struct work_struct *work)
+{
+	u32 deadline_us = ACCESS_ONCE(wb->barrier_deadline_us);
 
 	/*
 	 * queue_work does nothing if the work is already in the queue.
 	 * So we don't have to care about it.
 	 */
-	queue_work(wb->barrier_wq, &wb->flush_barrier_work);
+	if (!deadline_us) {
+		queue_work(wb->barrier_wq, work);
+		return;
+	}
+
+	if (wb->barrier_deadline_armed)
+		return;
+	wb->barrier_deadline_armed = true;
+	hrtimer_start(&wb->barrier_deadline_timer,
+		      ns_to_ktime((u64)deadline_us * 1000), HRTIMER_MODE_REL);
+}
+
+void queue_barrier_io(struct wb_device *wb, struct bio *bio)
+{
+	unsigned long flags;
+
+	/*
+	 * All the writes acked before this barrier are in the segments
+	 * allocated so far.
+	 */
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	bio_list_add(&wb->barrier_ios, bio);
+	wb->barrier_id = atomic64_read(&wb->last_allocated_segment_id);
+	start_barrier_deadline(wb, &wb->flush_barrier_work);
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+}
+
+/*
+ * Make all the data on the caching device persistent and ack the barrier
+ * requests. @flushed_id is the last segment flushed.
+ */
+static void ack_barrier_ios(struct wb_device *wb, struct bio_list *barrier_ios, u64 flushed_id)
+{
+	struct bio *bio;
+	int err;
+	u64 count = 0;
+
+	if (bio_list_empty(barrier_ios))
+		return;
+
+	/* Make all the preceding data persistent. */
+	err = flush_cache_devices(wb);
+	if (!err)
+		atomic64_set(&wb->last_durable_segment_id, flushed_id);
+
+	/* Ack the chained barrier requests. */
+	while ((bio = bio_list_pop(barrier_ios))) {
+		bio_endio_compat(bio, err);
+		count++;
+	}
+	atomic64_inc(&wb->count_barrier_commits);
+	atomic64_add(count, &wb->count_barrier_ios);
+}
+
+/*
+ * Ack the barrier requests if the segments they wait for are all flushed.
+ * @flushed_id is the last segment flushed.
+ */
+static void process_deferred_barriers(struct wb_device *wb, u64 flushed_id)
+{
+	struct bio_list barrier_ios;
+	unsigned long flags;
+
+	bio_list_init(&barrier_ios);
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	if (wb->barrier_id <= flushed_id) {
+		bio_list_merge(&barrier_ios, &wb->barrier_ios);
+		bio_list_init(&wb->barrier_ios);
+	}
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+
+	ack_barrier_ios(wb, &barrier_ios, flushed_id);
 }
 
 void flush_barrier_ios(struct work_struct *work)
 {
 	struct wb_device *wb = container_of(
 		work, struct wb_device, flush_barrier_work);
+	struct bio_list barrier_ios;
+	unsigned long flags;
 
 	if (bio_list_empty(&wb->barrier_ios))
 		return;
 
+	/*
+	 * The writes acked before the barriers queued so far are on the
+	 * caching device after sync_current_buffer(). The last segment may
+	 * be kept open so we don't wait for it to be flushed.
+	 */
+	bio_list_init(&barrier_ios);
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	bio_list_merge(&barrier_ios, &wb->barrier_ios);
+	bio_list_init(&wb->barrier_ios);
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+
 	atomic64_inc(&wb->count_non_full_flushed);
-	flush_current_buffer(wb);
+	sync_current_buffer(wb);
+	ack_barrier_ios(wb, &barrier_ios, atomic64_read(&wb->last_flushed_segment_id));
 }
 
 /*----------------------------------------------------------------------------*/
 
-static void process_deferred_barriers(struct wb_device *wb, struct rambuffer *rambuf)
+/*
+ * Is any open segment requested to be committed?
+ */
+static bool has_commit_request(struct wb_device *wb)
+{
+	u32 i;
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct segment_header *seg = ACCESS_ONCE(wb->log_heads[i].current_seg);
+		if (seg && ACCESS_ONCE(seg->commit_length) > ACCESS_ONCE(seg->nr_committed))
+			return true;
+	}
+	return false;
+}
+
+static bool should_flush(struct wb_device *wb)
 {
-	bool has_barrier = !bio_list_empty(&rambuf->barrier_ios);
-	if (has_barrier) {
-		struct bio *bio;
+	return atomic64_read(&wb->last_queued_segment_id) >
+	       atomic64_read(&wb->last_flushed_segment_id) ||
+	       has_commit_request(wb);
+}
 
-		/* Make all the preceding data persistent. */
-		int err = blkdev_issue_flush(wb->cache_dev->bdev, GFP_NOIO, NULL);
+/*
+ * Segments are flushed in the order of the id but with multiple log heads a
+ * later segment can be queued before the segment @id is sealed. In that case
+ * we seal the segment to not block the later ones.
+ *
+ * The owner of the log head may sleep with the lock held waiting for us (to
+ * acquire a RAM buffer) so we never block on the lock here. The caller retries.
+ */
+static void seal_lagging_log_head(struct wb_device *wb, u64 id)
+{
+	u32 i;
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct log_head *head = wb->log_heads + i;
+		struct segment_header *seg = ACCESS_ONCE(head->current_seg);
+		if (!seg || seg->id != id)
+			continue;
 
-		/* Ack the chained barrier requests. */
-		while ((bio = bio_list_pop(&rambuf->barrier_ios)))
-			bio_endio_compat(bio, err);
+		if (!mutex_trylock(&head->lock))
+			break;
+		if (head->current_seg && head->current_seg->id == id) {
+			atomic64_inc(&wb->count_non_full_flushed);
+			queue_current_buffer(wb, head);
+		}
+		mutex_unlock(&head->lock);
+		return;
 	}
+	schedule_timeout_interruptible(1);
 }
 
-static bool should_flush(struct wb_device *wb)
+/*
+ * Seal the open segments that no write is appended to for $idle_flush_ms.
+ * Returns the time to sleep until the next one gets idle or 0 if any segment
+ * is sealed. As seal_lagging_log_head() we never block on the lock.
+ */
+static unsigned long seal_idle_log_heads(struct wb_device *wb)
 {
-	return atomic64_read(&wb->last_queued_segment_id) >
-	       atomic64_read(&wb->last_flushed_segment_id);
+	unsigned long idle = msecs_to_jiffies(ACCESS_ONCE(wb->idle_flush_ms));
+	unsigned long timeout = msecs_to_jiffies(1000);
+	u32 i;
+
+	if (!ACCESS_ONCE(wb->idle_flush_ms))
+		return timeout;
+
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct log_head *head = wb->log_heads + i;
+		struct segment_header *seg = ACCESS_ONCE(head->current_seg);
+		unsigned long deadline;
+
+		if (!seg || !ACCESS_ONCE(seg->length))
+			continue;
+
+		deadline = ACCESS_ONCE(head->last_write) + idle;
+		if (time_before(jiffies, deadline)) {
+			timeout = min(timeout, deadline - jiffies);
+			continue;
+		}
+
+		if (!mutex_trylock(&head->lock)) {
+			timeout = 1;
+			continue;
+		}
+		if (head->current_seg && head->current_seg->length &&
+		    !time_before(jiffies, head->last_write + idle)) {
+			atomic64_inc(&wb->count_non_full_flushed);
+			queue_current_buffer(wb, head);
+			timeout = 0;
+		}
+		mutex_unlock(&head->lock);
+	}
+	return timeout;
 }
 
-static void do_flush_proc(struct wb_device *wb)
+static int write_segment(struct wb_device *wb, struct segment_header *seg,
+			 struct rambuffer *rambuf, bool fua)
 {
-	struct segment_header *seg;
-	struct rambuffer *rambuf;
-	u64 id;
 	struct dm_io_request io_req;
 	struct dm_io_region region;
 
-	if (!should_flush(wb)) {
-		schedule_timeout_interruptible(msecs_to_jiffies(1000));
-		return;
+	/*
+	 * The segment that FUA writes are on is written with FUA. The cache
+	 * of the caching device is flushed beforehand only if any preceding
+	 * segment was written without FUA since the last flush. The preflush
+	 * only covers the device written so the striped devices are flushed
+	 * separately.
+	 */
+	if (!fua)
+		io_req = (struct dm_io_request) { WB_IO_WRITE };
+	else if (atomic64_read(&wb->last_durable_segment_id) + 1 == seg->id)
+		io_req = (struct dm_io_request) { WB_IO_WRITE_FUA };
+	else if (wb->nr_cache_devs == 1)
+		io_req = (struct dm_io_request) { WB_IO_WRITE_FLUSH_FUA };
+	else {
+		int err = flush_cache_devices(wb);
+		if (err)
+			return err;
+		io_req = (struct dm_io_request) { WB_IO_WRITE_FUA };
 	}
+	io_req.client = wb->io_client;
+	io_req.notify.fn = NULL;
+	io_req.mem.type = DM_IO_VMA;
+	io_req.mem.ptr.addr = rambuf->data;
 
-	id = atomic64_read(&wb->last_flushed_segment_id) + 1;
+	region = (struct dm_io_region) {
+		.bdev = seg->cache_dev->bdev,
+		.sector = seg->start_sector,
+		.count = (wb->nr_header_blocks + seg->length) << 3,
+	};
 
-	smp_rmb();
+	return wb_io(&io_req, 1, &region, NULL, false);
+}
+
+/*
+ * Commit the metablocks [seg->nr_committed, @length) of the segment as a new
+ * chunk. The data is written first and then the header.
+ */
+static int commit_segment(struct wb_device *wb, struct segment_header *seg,
+			  struct rambuffer *rambuf, u32 length, bool fua)
+{
+	int err;
+	u32 from = seg->nr_committed;
+	struct dm_io_request io_req;
+	struct dm_io_region region;
 
-	rambuf = get_rambuffer_by_id(wb, id);
-	seg = rambuf->seg;
+	prepare_segment_chunk_device(rambuf->data, wb, seg, from, length);
 
-	io_req = (struct dm_io_request) {
+	if (length > from) {
+		io_req = (struct dm_io_request) {
+			WB_IO_WRITE,
+			.client = wb->io_client,
+			.notify.fn = NULL,
+			.mem.type = DM_IO_VMA,
+			.mem.ptr.addr = rambuf->data + ((wb->nr_header_blocks + from) << 12),
+		};
+		region = (struct dm_io_region) {
+			.bdev = seg->cache_dev->bdev,
+			.sector = seg->start_sector + ((wb->nr_header_blocks + from) << 3),
+			.count = (length - from) << 3,
+		};
+		err = wb_io(&io_req, 1, &region, NULL, false);
+		if (err)
+			return err;
+	}
+
+	/* The preceding chunks may not be persistent yet */
+	if (!fua)
+		io_req = (struct dm_io_request) { WB_IO_WRITE };
+	else if (wb->nr_cache_devs == 1)
+		io_req = (struct dm_io_request) { WB_IO_WRITE_FLUSH_FUA };
+	else {
+		err = flush_cache_devices(wb);
+		if (err)
+			return err;
+		io_req = (struct dm_io_request) { WB_IO_WRITE_FUA };
+	}
+	io_req.client = wb->io_client;
+	io_req.notify.fn = NULL;
+	io_req.mem.type = DM_IO_VMA;
+	io_req.mem.ptr.addr = rambuf->data;
+
+	region = (struct dm_io_region) {
+		.bdev = seg->cache_dev->bdev,
+		.sector = seg->start_sector,
+		.count = wb->nr_header_blocks << 3,
+	};
+	err = wb_io(&io_req, 1, &region, NULL, false);
+	if (err)
+		return err;
+
+	seg->nr_committed = length;
+	return 0;
+}
+
+static void segment_write_endio(unsigned long error, void *context)
+{
+	struct rambuffer *rambuf = context;
+	struct wb_device *wb = rambuf->wb;
+	u64 id = rambuf->seg->id;
+	u32 i, nr = rambuf->nr_batched;
+
+	if (error)
+		DMERR("Segment write failed. id(%llu), nr(%u), bits(%lu)",
+		      (unsigned long long) id, nr, error);
+
+	for (i = 0; i < nr; i++) {
+		rambuf = get_segment_header_by_id(wb, id + i)->rambuf;
+		rambuf->write_err = error ? -EIO : 0;
+		smp_wmb();
+		ACCESS_ONCE(rambuf->write_done) = true;
+	}
+	wake_up_process(wb->flush_daemon);
+}
+
+/*
+ * Count the sealed segments from @id (up to @max_nr) that can be written in
+ * one I/O. A segment follows the previous one only if the previous one is full
+ * and they are adjacent on the caching device.
+ */
+static u32 count_batched_segments(struct wb_device *wb, u64 id, u32 max_nr)
+{
+	u32 nr = 1;
+
+	if (!get_segment_header_by_id(wb, id)->rambuf->pages)
+		return nr;
+
+	while (nr < max_nr && id + nr <= atomic64_read(&wb->last_queued_segment_id)) {
+		struct segment_header *prev = get_segment_header_by_id(wb, id + nr - 1);
+		struct segment_header *seg = get_segment_header_by_id(wb, id + nr);
+		struct rambuffer *rambuf = ACCESS_ONCE(seg->rambuf);
+
+		if (prev->length != wb->nr_caches_inseg ||
+		    seg->cache_dev != prev->cache_dev ||
+		    seg->start_sector != prev->start_sector + (1 << wb->segment_size_order))
+			break;
+
+		if (seg->id != id + nr || !rambuf || ACCESS_ONCE(rambuf->seg) != seg)
+			break;
+		smp_rmb();
+
+		if (seg->commit_length || needs_fua_seg(wb, seg->id))
+			break;
+
+		nr++;
+	}
+	return nr;
+}
+
+/*
+ * Submit the writes of the @nr sealed segments from @id without waiting for
+ * them. The segments are written in one I/O by chaining the pages of their RAM
+ * buffers (cf. count_batched_segments). The completion is handled by
+ * retire_segments() in the order of the id.
+ */
+static void submit_segments(struct wb_device *wb, u64 id, u32 nr)
+{
+	struct segment_header *seg = get_segment_header_by_id(wb, id);
+	struct rambuffer *rambuf = seg->rambuf;
+	size_t nr_pages = (1 << (wb->segment_size_order + 9)) >> PAGE_SHIFT;
+	u32 i;
+
+	struct dm_io_request io_req = {
 		WB_IO_WRITE,
 		.client = wb->io_client,
-		.notify.fn = NULL,
+		.notify.fn = segment_write_endio,
+		.notify.context = rambuf,
 		.mem.type = DM_IO_VMA,
 		.mem.ptr.addr = rambuf->data,
 	};
-	region = (struct dm_io_region) {
-		.bdev = wb->cache_dev->bdev,
+	struct dm_io_region region = {
+		.bdev = seg->cache_dev->bdev,
 		.sector = seg->start_sector,
-		.count = (seg->length + 1) << 3,
+		.count = 0,
 	};
 
+	if (nr > 1) {
+		io_req.mem.type = DM_IO_PAGE_LIST;
+		io_req.mem.ptr.pl = rambuf->pages;
+		io_req.mem.offset = 0;
+	}
+
+	rambuf->nr_batched = nr;
+	for (i = 0; i < nr; i++) {
+		struct segment_header *cur = get_segment_header_by_id(wb, id + i);
+		struct rambuffer *cur_rambuf = cur->rambuf;
+
+		if (nr > 1)
+			cur_rambuf->pages[nr_pages - 1].next = (i + 1 < nr) ?
+				get_segment_header_by_id(wb, id + i + 1)->rambuf->pages : NULL;
+
+		prepare_segment_header_device(cur_rambuf->data, wb, cur);
+		cur_rambuf->write_done = false;
+		cur_rambuf->write_err = 0;
+		region.count += (wb->nr_header_blocks + cur->length) << 3;
+	}
+
 	if (wb_io(&io_req, 1, &region, NULL, false))
-		return;
+		segment_write_endio(1, rambuf);
+}
+
+/*
+ * Sleep until the write of the segment @id completes. Any other event that
+ * wakes up the flush daemon (e.g. a segment is queued) also ends the sleep.
+ */
+static void wait_for_segment_write(struct wb_device *wb, u64 id)
+{
+	struct rambuffer *rambuf = get_segment_header_by_id(wb, id)->rambuf;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (!ACCESS_ONCE(rambuf->write_done))
+		schedule_timeout(msecs_to_jiffies(1000));
+	__set_current_state(TASK_RUNNING);
+}
+
+static void finish_flushing(struct wb_device *wb, struct segment_header *seg,
+			    struct rambuffer *rambuf)
+{
+	u64 id = seg->id;
 
 	/*
 	 * Deferred ACK for barrier requests
 	 * To serialize barrier ACK in logging we wait for the previous segment
 	 * to be persistently written (if needed).
 	 */
-	process_deferred_barriers(wb, rambuf);
+	process_deferred_barriers(wb, id);
+
+	/* The writeback daemon reads the order once the segment is flushed */
+	sort_segment_mbs(seg);
 
 	/*
 	 * We can count up the last_flushed_segment_id only after segment
 	 * is written persistently. Counting up the id is serialized.
 	 */
+	rambuf->seg = NULL;
+	seg->rambuf = NULL;
+	put_rambuffer(wb, rambuf);
 	smp_wmb();
 	atomic64_inc(&wb->last_flushed_segment_id);
 	wake_up(&wb->flush_wait_queue);
+
+	process_deferred_fua_ios(wb, id);
+}
+
+/*
+ * The segment writes may complete out of order but last_flushed_segment_id
+ * is counted up in order. A failed write is submitted again.
+ */
+static void retire_segments(struct wb_device *wb)
+{
+	u64 id;
+	for (id = atomic64_read(&wb->last_flushed_segment_id) + 1;
+	     id <= wb->last_submitted_segment_id; id++) {
+		struct segment_header *seg = get_segment_header_by_id(wb, id);
+		struct rambuffer *rambuf = seg->rambuf;
+		if (!ACCESS_ONCE(rambuf->write_done))
+			return;
+		smp_rmb();
+		if (rambuf->write_err) {
+			submit_segments(wb, id, 1);
+			return;
+		}
+		finish_flushing(wb, seg, rambuf);
+	}
+}
+
+static void do_flush_proc(struct wb_device *wb)
+{
+	struct segment_header *seg;
+	struct rambuffer *rambuf;
+	u64 id, nr_inflight;
+	bool fua;
+	int err;
+
+	retire_segments(wb);
+
+	if (!should_flush(wb)) {
+		unsigned long timeout;
+
+		/* Release the RAM buffers allocated on the write bursts */
+		shrink_rambuf_pool(wb);
+		timeout = seal_idle_log_heads(wb);
+		if (timeout)
+			schedule_timeout_interruptible(timeout);
+		return;
+	}
+
+	id = wb->last_submitted_segment_id + 1;
+	nr_inflight = wb->last_submitted_segment_id -
+		      atomic64_read(&wb->last_flushed_segment_id);
+
+	/*
+	 * The open segment is committed only after the preceding writes
+	 * complete because it may be sealed and written in full anytime.
+	 */
+	if (id > atomic64_read(&wb->last_queued_segment_id) ||
+	    nr_inflight >= NR_MAX_INFLIGHT_SEGMENTS) {
+		if (nr_inflight) {
+			wait_for_segment_write(wb, id - nr_inflight);
+			return;
+		}
+	}
+
+	seg = get_segment_header_by_id(wb, id);
+	rambuf = ACCESS_ONCE(seg->rambuf);
+	if (seg->id != id || !rambuf) {
+		seal_lagging_log_head(wb, id);
+		return;
+	}
+
+	/* The segment is still open. Commit it if requested */
+	if (ACCESS_ONCE(rambuf->seg) != seg) {
+		u32 length = ACCESS_ONCE(seg->commit_length);
+		if (nr_inflight || length <= seg->nr_committed) {
+			seal_lagging_log_head(wb, id);
+			return;
+		}
+		smp_rmb();
+		if (!commit_segment(wb, seg, rambuf, length, false))
+			wake_up(&wb->flush_wait_queue);
+		return;
+	}
+
+	smp_rmb();
+
+	fua = needs_fua_seg(wb, id);
+	if (!fua && !seg->commit_length) {
+		u32 nr = count_batched_segments(wb, id, NR_MAX_INFLIGHT_SEGMENTS - nr_inflight);
+		submit_segments(wb, id, nr);
+		wb->last_submitted_segment_id = id + nr - 1;
+		return;
+	}
+
+	/*
+	 * The segment written with FUA must follow the preceding writes
+	 * because it can make them persistent only if they are completed.
+	 * The continued segment is written in two steps.
+	 * Both are written synchronously after the pipeline drains.
+	 */
+	if (nr_inflight) {
+		wait_for_segment_write(wb, id - nr_inflight);
+		return;
+	}
+
+	if (seg->commit_length)
+		err = commit_segment(wb, seg, rambuf, seg->length, fua);
+	else {
+		prepare_segment_header_device(rambuf->data, wb, seg);
+		err = write_segment(wb, seg, rambuf, fua);
+	}
+	if (err)
+		return;
+
+	if (fua)
+		atomic64_set(&wb->last_durable_segment_id, id);
+
+	wb->last_submitted_segment_id = id;
+	finish_flushing(wb, seg, rambuf);
 }
 
 int flush_daemon_proc(void *data)
 {
 	struct wb_device *wb = data;
+	u64 id;
+
 	while (!kthread_should_stop())
 		do_flush_proc(wb);
+
+	/* Don't leave the segment writes in flight */
+	for (id = atomic64_read(&wb->last_flushed_segment_id) + 1;
+	     id <= wb->last_submitted_segment_id; id++) {
+		struct rambuffer *rambuf = get_segment_header_by_id(wb, id)->rambuf;
+		while (!ACCESS_ONCE(rambuf->write_done))
+			wait_for_segment_write(wb, id);
+	}
 	return 0;
 }
 
@@ -140,6 +636,18 @@ void wait_for_flushing(struct wb_device *wb, u64 id)
 	smp_rmb();
 }
 
+/*
+ * Wait for the first @length metablocks of the segment @id to be on the caching
+ * device. The segment may be still open but committed.
+ */
+void wait_for_committing(struct wb_device *wb, struct segment_header *seg, u64 id, u32 length)
+{
+	wait_event(wb->flush_wait_queue,
+		atomic64_read(&wb->last_flushed_segment_id) >= id ||
+		ACCESS_ONCE(seg->nr_committed) >= length);
+	smp_rmb();
+}
+
 /*----------------------------------------------------------------------------*/
 
 static void writeback_endio(unsigned long error, void *context)
@@ -153,176 +661,356 @@ static void writeback_endio(unsigned long error, void *context)
 		wake_up(&wb->writeback_io_wait_queue);
 }
 
+/*
+ * dm_io() builds the bios before it returns so the page list can be reused for
+ * the next run.
+ */
+static void submit_writeback_run(struct wb_device *wb, struct writeback_run *run)
+{
+	struct dm_io_request io_req_w = {
+		WB_IO_WRITE,
+		.client = wb->io_client,
+		.notify.fn = writeback_endio,
+		.notify.context = wb,
+		.mem.type = DM_IO_PAGE_LIST,
+		.mem.ptr.pl = run->pages,
+		.mem.offset = run->offset,
+	};
+	struct dm_io_region region_w = {
+		.bdev = wb->backing_dev->bdev,
+		.sector = run->sector,
+		.count = run->count,
+	};
+
+	if (!run->nr_pages)
+		return;
+
+	atomic_inc(&wb->writeback_io_count);
+	if (wb_io(&io_req_w, 1, &region_w, NULL, false))
+		writeback_endio(1, wb);
+
+	run->count = 0;
+	run->nr_pages = 0;
+}
+
+/*
+ * Append the @count sectors of @data to the run if they follow it on the
+ * backing device. Otherwise the run is submitted and a new one starts.
+ */
+static void add_writeback_run(struct wb_device *wb, struct writeback_run *run,
+			      sector_t sector, void *data, unsigned count)
+{
+	struct page *page = vmalloc_to_page(data);
+	unsigned offset = offset_in_page(data);
+	struct page_list *pl;
+
+	if (run->nr_pages && run->sector + run->count != sector)
+		submit_writeback_run(wb, run);
+
+	if (run->nr_pages) {
+		/* The data contiguous in the same page extend the last page */
+		pl = run->pages + run->nr_pages - 1;
+		if (pl->page == page && run->end == offset) {
+			run->end += count << 9;
+			run->count += count;
+			return;
+		}
+
+		/* Otherwise the data must start a new page after a full page */
+		if (run->end != PAGE_SIZE || offset ||
+		    run->nr_pages == NR_MAX_WRITEBACK_RUN)
+			submit_writeback_run(wb, run);
+	}
+
+	if (!run->nr_pages) {
+		run->sector = sector;
+		run->offset = offset;
+	} else
+		run->pages[run->nr_pages - 1].next = run->pages + run->nr_pages;
+
+	pl = run->pages + run->nr_pages++;
+	pl->page = page;
+	pl->next = NULL;
+	run->end = offset + (count << 9);
+	run->count += count;
+}
+
+/*
+ * Every run of the set bits is appended to the writeback run. A partially
+ * valid block is merged with the neighbouring blocks if the run reaches the
+ * edge of the block.
+ */
 static void submit_writeback_io(struct wb_device *wb, struct writeback_io *writeback_io)
 {
-	ASSERT(writeback_io->data_bits > 0);
+	u8 data_bits = writeback_io->data_bits;
+	u8 i = 0, j;
 
-	if (writeback_io->data_bits == 255) {
-		struct dm_io_request io_req_w = {
-			WB_IO_WRITE,
-			.client = wb->io_client,
-			.notify.fn = writeback_endio,
-			.notify.context = wb,
-			.mem.type = DM_IO_VMA,
-			.mem.ptr.addr = writeback_io->data,
-		};
-		struct dm_io_region region_w = {
-			.bdev = wb->backing_dev->bdev,
-			.sector = writeback_io->sector,
-			.count = 1 << 3,
-		};
-		if (wb_io(&io_req_w, 1, &region_w, NULL, false))
-			writeback_endio(1, wb);
-	} else {
-		u8 i;
-		for (i = 0; i < 8; i++) {
-			struct dm_io_request io_req_w;
-			struct dm_io_region region_w;
-
-			bool bit_on = writeback_io->data_bits & (1 << i);
-			if (!bit_on)
-				continue;
-
-			io_req_w = (struct dm_io_request) {
-				WB_IO_WRITE,
-				.client = wb->io_client,
-				.notify.fn = writeback_endio,
-				.notify.context = wb,
-				.mem.type = DM_IO_VMA,
-				.mem.ptr.addr = writeback_io->data + (i << 9),
-			};
-			region_w = (struct dm_io_region) {
-				.bdev = wb->backing_dev->bdev,
-				.sector = writeback_io->sector + i,
-				.count = 1,
-			};
-			if (wb_io(&io_req_w, 1, &region_w, NULL, false))
-				writeback_endio(1, wb);
+	ASSERT(data_bits > 0);
+
+	while (i < 8) {
+		if (!(data_bits & (1 << i))) {
+			i++;
+			continue;
 		}
+
+		j = i + 1;
+		while (j < 8 && (data_bits & (1 << j)))
+			j++;
+
+		add_writeback_run(wb, &wb->writeback_run, writeback_io->sector + i,
+				  writeback_io->data + (i << 9), j - i);
+		i = j;
 	}
 }
 
-static void submit_writeback_ios(struct wb_device *wb)
+/*
+ * Merge two writeback IOs of the same sector into @dst so only one backing
+ * write is issued for a sector in a batch. The sectors of the newer one win.
+ * The data is copied because writeback_io->data is bound to the buffer slot.
+ */
+static void merge_writeback_io(struct writeback_io *dst, struct writeback_io *src)
 {
-	struct blk_plug plug;
-	struct rb_root wt = wb->writeback_tree;
-	blk_start_plug(&plug);
-	while (!RB_EMPTY_ROOT(&wt)) {
-		struct writeback_io *writeback_io = writeback_io_from_node(rb_first(&wt));
-		rb_erase(&writeback_io->rb_node, &wt);
-		submit_writeback_io(wb, writeback_io);
+	bool src_newer = src->id >= dst->id;
+	u8 i;
+
+	for (i = 0; i < 8; i++) {
+		u8 bit = 1 << i;
+		if (!(src->data_bits & bit))
+			continue;
+		if (src_newer || !(dst->data_bits & bit))
+			memcpy(dst->data + (i << 9), src->data + (i << 9), 1 << 9);
 	}
-	blk_finish_plug(&plug);
+	dst->data_bits |= src->data_bits;
+	dst->id = max(dst->id, src->id);
+}
+
+static struct writeback_io *cur_writeback_io(struct writeback_segment *writeback_seg)
+{
+	struct segment_header *seg = writeback_seg->seg;
+	u32 pos = writeback_seg->start + writeback_seg->cursor;
+	if (pos >= seg->length)
+		pos -= seg->length;
+	return writeback_seg->ios + seg->mb_array[pos].sorted_idx;
 }
 
 /*
- * Compare two writeback IOs
- * If the two have the same sector then compare them with the IDs.
- * We process the older ID first and then overwrites with the older.
- *
- * (10, 3) < (11, 1)
- * (10, 3) < (10, 4)
+ * Find the first sorted position of the sector not below @sector.
+ * Returns the length of the segment if there is none.
  */
-static bool compare_writeback_io(struct writeback_io *a, struct writeback_io *b)
-{
-	ASSERT(a);
-	ASSERT(b);
-	if (a->sector < b->sector)
-		return true;
-	if (a->id < b->id)
-		return true;
+static u32 find_sweep_start(struct segment_header *seg, sector_t sector)
+{
+	u32 lo = 0, hi = seg->length;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (seg->mb_array[seg->mb_array[mid].sorted_idx].sector < sector)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Move the cursor to the next dirty cache in the sorted order.
+ * Returns false if the segment has no more.
+ */
+static bool seek_writeback_seg(struct writeback_segment *writeback_seg)
+{
+	while (writeback_seg->cursor < writeback_seg->seg->length) {
+		if (cur_writeback_io(writeback_seg)->data_bits)
+			return true;
+		writeback_seg->cursor++;
+	}
 	return false;
 }
 
-static void inc_writeback_io_count(u8 data_bits, size_t *writeback_io_count)
+/*
+ * The distance from the sweep position. The sectors below it wrap around to
+ * the end of the sweep.
+ */
+static sector_t heap_key(struct wb_device *wb, u32 i)
 {
-	if (data_bits == 255) {
-		(*writeback_io_count)++;
-	} else {
-		u8 i;
-		for (i = 0; i < 8; i++) {
-			if (data_bits & (1 << i))
-				(*writeback_io_count)++;
-		}
+	return cur_writeback_io(wb->writeback_heap[i])->sector - wb->writeback_sweep;
+}
+
+static void sift_down_writeback_heap(struct wb_device *wb, u32 nr, u32 i)
+{
+	struct writeback_segment **heap = wb->writeback_heap;
+	u32 l;
+	while ((l = 2 * i + 1) < nr) {
+		u32 min = i;
+		if (heap_key(wb, l) < heap_key(wb, min))
+			min = l;
+		if (l + 1 < nr && heap_key(wb, l + 1) < heap_key(wb, min))
+			min = l + 1;
+		if (min == i)
+			return;
+		swap(heap[i], heap[min]);
+		i = min;
 	}
 }
 
 /*
- * Add writeback IO to RB-tree for sorted writeback.
- * All writeback IOs are sorted in ascending order.
+ * The metablocks of each segment are already sorted (cf. sort_segment_mbs) so
+ * the segments in the batch are merged through a min-heap keyed by the sector
+ * of their next dirty caches. The writeback ios of the same sector come out in
+ * a row and are merged before submitted.
+ *
+ * The merge starts from the sector where the previous batch ended and wraps
+ * around to the lowest sector (C-SCAN) so the backing device doesn't seek
+ * back to the lowest sector at every batch.
  */
-static void add_writeback_io(struct wb_device *wb, struct writeback_io *writeback_io)
-{
-	struct rb_node **rbp, *parent;
-	rbp = &wb->writeback_tree.rb_node;
-	parent = NULL;
-	while (*rbp) {
-		struct writeback_io *parent_io;
-		parent = *rbp;
-		parent_io = writeback_io_from_node(parent);
-
-		if (compare_writeback_io(writeback_io, parent_io))
-			rbp = &(*rbp)->rb_left;
-		else
-			rbp = &(*rbp)->rb_right;
+static void submit_writeback_ios(struct wb_device *wb)
+{
+	struct writeback_segment **heap = wb->writeback_heap;
+	struct writeback_io *pending = NULL;
+	struct blk_plug plug;
+	u32 k, nr = 0;
+
+	for (k = 0; k < wb->nr_cur_batched_writeback; k++) {
+		struct writeback_segment *writeback_seg = *(wb->writeback_segs + k);
+		writeback_seg->start = find_sweep_start(writeback_seg->seg, wb->writeback_sweep);
+		if (seek_writeback_seg(writeback_seg))
+			heap[nr++] = writeback_seg;
 	}
-	rb_link_node(&writeback_io->rb_node, parent, rbp);
-	rb_insert_color(&writeback_io->rb_node, &wb->writeback_tree);
+	for (k = nr / 2; k > 0; k--)
+		sift_down_writeback_heap(wb, nr, k - 1);
+
+	blk_start_plug(&plug);
+	while (nr) {
+		struct writeback_segment *writeback_seg = heap[0];
+		struct writeback_io *writeback_io = cur_writeback_io(writeback_seg);
+
+		if (pending && pending->sector == writeback_io->sector)
+			merge_writeback_io(pending, writeback_io);
+		else {
+			if (pending)
+				submit_writeback_io(wb, pending);
+			pending = writeback_io;
+		}
+
+		writeback_seg->cursor++;
+		if (!seek_writeback_seg(writeback_seg))
+			heap[0] = heap[--nr];
+		sift_down_writeback_heap(wb, nr, 0);
+	}
+	if (pending) {
+		submit_writeback_io(wb, pending);
+		wb->writeback_sweep = pending->sector + (1 << 3);
+	}
+	submit_writeback_run(wb, &wb->writeback_run);
+	blk_finish_plug(&plug);
 }
 
+struct writeback_read_context {
+	atomic_t count;
+	int err;
+	struct completion done;
+};
+
+static void writeback_read_endio(unsigned long error, void *context)
+{
+	struct writeback_read_context *ctx = context;
+
+	if (error)
+		ctx->err = -EIO;
+
+	if (atomic_dec_and_test(&ctx->count))
+		complete(&ctx->done);
+}
+
+/*
+ * Read the runs of the dirty caches in the segment. The clean caches are never
+ * written back (cf. prepare_writeback_ios) so they aren't read and the segment
+ * with no dirty cache isn't read at all. The caches in the flushed segment
+ * never get dirty again.
+ */
 static int fill_writeback_seg(struct wb_device *wb, struct writeback_segment *writeback_seg)
 {
 	struct segment_header *seg = writeback_seg->seg;
+	struct writeback_read_context ctx;
+	struct blk_plug plug;
+	u32 i = 0, j;
 
-	struct dm_io_request io_req_r = {
-		WB_IO_READ,
-		.client = wb->io_client,
-		.notify.fn = NULL,
-		.mem.type = DM_IO_VMA,
-		.mem.ptr.addr = writeback_seg->buf,
-	};
-	struct dm_io_region region_r = {
-		.bdev = wb->cache_dev->bdev,
-		.sector = seg->start_sector + (1 << 3), /* Header excluded */
-		.count = seg->length << 3,
-	};
+	/* Biased by one until all the reads are submitted */
+	atomic_set(&ctx.count, 1);
+	ctx.err = 0;
+	init_completion(&ctx.done);
 
-	/*
-	 * dm_io() allows region.count = 0
-	 * so we don't need to skip here in case of seg->length = 0
-	 */
-	return wb_io(&io_req_r, 1, &region_r, NULL, false);
+	blk_start_plug(&plug);
+	while (i < seg->length) {
+		struct dm_io_request io_req_r;
+		struct dm_io_region region_r;
+
+		if (!read_mb_dirtiness(wb, seg, seg->mb_array + i).is_dirty) {
+			i++;
+			continue;
+		}
+
+		j = i + 1;
+		while (j < seg->length && read_mb_dirtiness(wb, seg, seg->mb_array + j).is_dirty)
+			j++;
+
+		io_req_r = (struct dm_io_request) {
+			WB_IO_READ,
+			.client = wb->io_client,
+			.notify.fn = writeback_read_endio,
+			.notify.context = &ctx,
+			.mem.type = DM_IO_VMA,
+			.mem.ptr.addr = writeback_seg->buf + (i << 12),
+		};
+		region_r = (struct dm_io_region) {
+			.bdev = seg->cache_dev->bdev,
+			.sector = seg->start_sector + ((wb->nr_header_blocks + i) << 3),
+			.count = (j - i) << 3,
+		};
+		atomic_inc(&ctx.count);
+		if (wb_io(&io_req_r, 1, &region_r, NULL, false))
+			writeback_read_endio(1, &ctx);
+
+		i = j;
+	}
+	blk_finish_plug(&plug);
+
+	writeback_read_endio(0, &ctx);
+	wait_for_completion(&ctx.done);
+
+	if (ctx.err)
+		DMERR("Failed to read the segment to write back. id(%llu)",
+		      (unsigned long long) seg->id);
+	return ctx.err;
 }
 
-static void prepare_writeback_ios(struct wb_device *wb, struct writeback_segment *writeback_seg,
-				  size_t *writeback_io_count)
+static void prepare_writeback_ios(struct wb_device *wb, struct writeback_segment *writeback_seg)
 {
 	struct segment_header *seg = writeback_seg->seg;
 
-	u8 i;
+	u32 i;
 	for (i = 0; i < seg->length; i++) {
 		struct writeback_io *writeback_io;
 
 		struct metablock *mb = seg->mb_array + i;
 		struct dirtiness dirtiness = read_mb_dirtiness(wb, seg, mb);
 		ASSERT(dirtiness.data_bits > 0);
-		if (!dirtiness.is_dirty)
-			continue;
 
 		writeback_io = writeback_seg->ios + i;
+		if (!dirtiness.is_dirty) {
+			/* Skipped in the merge */
+			writeback_io->data_bits = 0;
+			continue;
+		}
+
 		writeback_io->sector = mb->sector;
 		writeback_io->id = seg->id;
 		/* writeback_io->data is already set */
 		writeback_io->data_bits = dirtiness.data_bits;
-
-		inc_writeback_io_count(writeback_io->data_bits, writeback_io_count);
-		add_writeback_io(wb, writeback_io);
 	}
+	writeback_seg->cursor = 0;
 }
 
 void mark_clean_seg(struct wb_device *wb, struct segment_header *seg)
 {
-	u8 i;
+	u32 i;
 	for (i = 0; i < seg->length; i++) {
 		struct metablock *mb = seg->mb_array + i;
 		if (mark_clean_mb(wb, mb))
@@ -330,31 +1018,73 @@ void mark_clean_seg(struct wb_device *wb, struct segment_header *seg)
 	}
 }
 
+/*
+ * Read the segments following the current batch into the second half of
+ * writeback_segs. As many segments as the current batch are read ahead
+ * because the next batch is likely as large.
+ *
+ * The segments flushed aren't reused until they are written back so the data
+ * read ahead stays valid.
+ */
+static void prefetch_writeback_segs(struct wb_device *wb)
+{
+	u64 id = atomic64_read(&wb->last_writeback_segment_id) + wb->nr_cur_batched_writeback + 1;
+	u64 last_flushed = atomic64_read(&wb->last_flushed_segment_id);
+	u32 k;
+
+	smp_rmb();
+	for (k = 0; k < wb->nr_cur_batched_writeback && id + k <= last_flushed; k++) {
+		struct writeback_segment *writeback_seg = *(wb->writeback_segs + wb->nr_writeback_segs + k);
+		writeback_seg->seg = get_segment_header_by_id(wb, id + k);
+		if (fill_writeback_seg(wb, writeback_seg))
+			break;
+		wb->nr_prefetched_writeback++;
+	}
+}
+
+/*
+ * Swap the halves of writeback_segs so the segments read ahead are used in
+ * the next batch.
+ */
+static void swap_writeback_segs(struct wb_device *wb)
+{
+	u32 k;
+	for (k = 0; k < wb->nr_writeback_segs; k++)
+		swap(wb->writeback_segs[k], wb->writeback_segs[wb->nr_writeback_segs + k]);
+}
+
 /*
  * Try writeback some specified segs and returns if all writeback ios succeeded.
+ * The segments read ahead in the previous batch aren't read again. The next
+ * segments are read ahead while the writeback ios are in flight.
  */
 static bool try_writeback_segs(struct wb_device *wb)
 {
 	struct writeback_segment *writeback_seg;
-	size_t writeback_io_count = 0;
+	u32 nr_prefetched = wb->nr_prefetched_writeback;
 	u32 k;
 
-	/* Create RB-tree */
-	wb->writeback_tree = RB_ROOT;
+	wb->nr_prefetched_writeback = 0;
+
 	for (k = 0; k < wb->nr_cur_batched_writeback; k++) {
 		writeback_seg = *(wb->writeback_segs + k);
 
-		if (fill_writeback_seg(wb, writeback_seg))
+		if (k >= nr_prefetched && fill_writeback_seg(wb, writeback_seg))
 			return false;
 
-		prepare_writeback_ios(wb, writeback_seg, &writeback_io_count);
+		prepare_writeback_ios(wb, writeback_seg);
 	}
 
-	atomic_set(&wb->writeback_io_count, writeback_io_count);
+	/*
+	 * The count is biased by one while submitting because the number of
+	 * the I/Os is known only after the writeback ios are merged.
+	 */
+	atomic_set(&wb->writeback_io_count, 1);
 	atomic_set(&wb->writeback_fail_count, 0);
 
-	/* Pop rbnodes out of the tree and submit writeback I/Os */
 	submit_writeback_ios(wb);
+	prefetch_writeback_segs(wb);
+	atomic_dec(&wb->writeback_io_count);
 	wait_event(wb->writeback_io_wait_queue, !atomic_read(&wb->writeback_io_count));
 
 	return atomic_read(&wb->writeback_fail_count) == 0;
@@ -375,8 +1105,8 @@ static bool do_writeback_segs(struct wb_device *wb)
 void update_nr_empty_segs(struct wb_device *wb)
 {
 	wb->nr_empty_segs =
-		atomic64_read(&wb->last_writeback_segment_id) + wb->nr_segments
-		- wb->current_seg->id;
+		SUB_ID(atomic64_read(&wb->last_writeback_segment_id) + wb->nr_segments,
+		       atomic64_read(&wb->last_allocated_segment_id));
 }
 
 static u32 calc_nr_writeback(struct wb_device *wb)
@@ -419,13 +1149,18 @@ static void do_writeback_proc(struct wb_device *wb)
 	/* Store segments into writeback_segs */
 	for (k = 0; k < nr_writeback_tbd; k++) {
 		struct writeback_segment *writeback_seg = *(wb->writeback_segs + k);
-		writeback_seg->seg = get_segment_header_by_id(wb,
+		struct segment_header *seg = get_segment_header_by_id(wb,
 			atomic64_read(&wb->last_writeback_segment_id) + 1 + k);
+		ASSERT(k >= wb->nr_prefetched_writeback || writeback_seg->seg == seg);
+		writeback_seg->seg = seg;
 	}
 	wb->nr_cur_batched_writeback = nr_writeback_tbd;
 
-	if (!do_writeback_segs(wb))
+	if (!do_writeback_segs(wb)) {
+		/* The segments read ahead aren't of the retried batch */
+		wb->nr_prefetched_writeback = 0;
 		return;
+	}
 
 	/* A segment after written back is clean */
 	for (k = 0; k < wb->nr_cur_batched_writeback; k++) {
@@ -433,6 +1168,8 @@ static void do_writeback_proc(struct wb_device *wb)
 		mark_clean_seg(wb, writeback_seg->seg);
 	}
 
+	swap_writeback_segs(wb);
+
 	smp_wmb();
 	atomic64_add(wb->nr_cur_batched_writeback, &wb->last_writeback_segment_id);
 	wake_up(&wb->writeback_wait_queue);
@@ -491,15 +1228,23 @@ int writeback_modulator_proc(void *data)
 
 /*----------------------------------------------------------------------------*/
 
-static void update_superblock_record(struct wb_device *wb)
+/*
+ * Record the last segment id written back in the superblock.
+ * thread: see wb_io()
+ */
+int update_superblock_record(struct wb_device *wb, bool thread)
 {
+	int err;
 	struct superblock_record_device o;
 	void *buf;
 	struct dm_io_request io_req;
 	struct dm_io_region region;
+	u64 id;
 
-	o.last_writeback_segment_id =
-		cpu_to_le64(atomic64_read(&wb->last_writeback_segment_id));
+	mutex_lock(&wb->sb_record_lock);
+
+	id = atomic64_read(&wb->last_writeback_segment_id);
+	o.last_writeback_segment_id = cpu_to_le64(id);
 
 	buf = mempool_alloc(wb->buf_1_pool, GFP_NOIO);
 	memset(buf, 0, 1 << 9);
@@ -513,13 +1258,18 @@ static void update_superblock_record(struct wb_device *wb)
 		.mem.ptr.addr = buf,
 	};
 	region = (struct dm_io_region) {
-		.bdev = wb->cache_dev->bdev,
+		.bdev = wb->cache_devs[0]->bdev,
 		.sector = (1 << 11) - 1,
 		.count = 1,
 	};
-	wb_io(&io_req, 1, &region, NULL, false);
+	err = wb_io(&io_req, 1, &region, NULL, thread);
+	if (!err)
+		atomic64_set(&wb->last_recorded_segment_id, id);
 
 	mempool_free(buf, wb->buf_1_pool);
+
+	mutex_unlock(&wb->sb_record_lock);
+	return err;
 }
 
 int sb_record_updater_proc(void *data)
@@ -537,7 +1287,7 @@ int sb_record_updater_proc(void *data)
 			continue;
 		}
 
-		update_superblock_record(wb);
+		update_superblock_record(wb, false);
 		schedule_timeout_interruptible(msecs_to_jiffies(intvl));
 	}
 	return 0;
@@ -559,8 +1309,8 @@ int data_synchronizer_proc(void *data)
 			continue;
 		}
 
-		flush_current_buffer(wb);
-		blkdev_issue_flush(wb->cache_dev->bdev, GFP_NOIO, NULL);
+		sync_current_buffer(wb);
+		flush_cache_devices(wb);
 		schedule_timeout_interruptible(msecs_to_jiffies(intvl));
 	}
 	return 0;
@@ -24,9 +24,12 @@
 
 int flush_daemon_proc(void *);
 void wait_for_flushing(struct wb_device *, u64 id);
+void wait_for_committing(struct wb_device *, struct segment_header *, u64 id, u32 length);
 
 /*----------------------------------------------------------------------------*/
 
+void start_barrier_deadline(struct wb_device *, struct work_struct *);
+enum hrtimer_restart barrier_deadline_proc(struct hrtimer *);
 void queue_barrier_io(struct wb_device *, struct bio *);
 void flush_barrier_ios(struct work_struct *);
 
@@ -47,6 +50,7 @@ int data_synchronizer_proc(void *);
 
 /*----------------------------------------------------------------------------*/
 
+int update_superblock_record(struct wb_device *, bool thread);
 int sb_record_updater_proc(void *);
 
 /*----------------------------------------------------------------------------*/
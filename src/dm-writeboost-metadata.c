@@ -82,32 +82,53 @@ static void mb_array_empty_init(struct wb_device *wb)
 	u32 i;
 	for (i = 0; i < wb->nr_caches; i++) {
 		struct metablock *mb = mb_at(wb, i);
-		INIT_HLIST_NODE(&mb->ht_list);
+		mb->ht_list.pprev = NULL; /* Unhashed */
 
 		mb->idx = i;
 		mb->dirtiness.data_bits = 0;
 		mb->dirtiness.is_dirty = false;
+		mb->sorted_idx = mb_idx_inseg(wb, i);
 	}
 }
 
 /*
- * Calc the starting sector of the k-th segment
+ * Calc the starting sector of the k-th segment. The segments are striped over
+ * the cache devices so the k-th one is at the (k / nr_cache_devs)-th row of
+ * its device.
  */
 static sector_t calc_segment_header_start(struct wb_device *wb, u32 k)
 {
-	return (1 << 11) + (1 << SEGMENT_SIZE_ORDER) * k;
+	return (1 << 11) + ((sector_t) (k / wb->nr_cache_devs) << wb->segment_size_order);
 }
 
-static u32 calc_nr_segments(struct dm_dev *dev, struct wb_device *wb)
+/*
+ * The k-th segment is on the (k % nr_cache_devs)-th cache device.
+ */
+static struct dm_dev *calc_segment_cache_dev(struct wb_device *wb, u32 k)
 {
-	sector_t devsize = dm_devsize(dev);
-	return div_u64(devsize - (1 << 11), 1 << SEGMENT_SIZE_ORDER);
+	return wb->cache_devs[k % wb->nr_cache_devs];
+}
+
+/*
+ * Every cache device has the same number of segments. The smallest one
+ * decides it.
+ */
+static u32 calc_nr_segments(struct wb_device *wb)
+{
+	u32 i, nr_segments = 0;
+	for (i = 0; i < wb->nr_cache_devs; i++) {
+		sector_t devsize = dm_devsize(wb->cache_devs[i]);
+		u32 nr = div_u64(devsize - (1 << 11), 1 << wb->segment_size_order);
+		if (!i || nr < nr_segments)
+			nr_segments = nr;
+	}
+	return nr_segments * wb->nr_cache_devs;
 }
 
 /*
  * Get the relative index in a segment of the mb_idx-th metablock
  */
-u8 mb_idx_inseg(struct wb_device *wb, u32 mb_idx)
+u32 mb_idx_inseg(struct wb_device *wb, u32 mb_idx)
 {
 	u32 tmp32;
 	div_u64_rem(mb_idx, wb->nr_caches_inseg, &tmp32);
@@ -119,7 +140,7 @@ u8 mb_idx_inseg(struct wb_device *wb, u32 mb_idx)
  */
 sector_t calc_mb_start_sector(struct wb_device *wb, struct segment_header *seg, u32 mb_idx)
 {
-	return seg->start_sector + ((1 + mb_idx_inseg(wb, mb_idx)) << 3);
+	return seg->start_sector + ((wb->nr_header_blocks + mb_idx_inseg(wb, mb_idx)) << 3);
 }
 
 /*
@@ -134,16 +155,14 @@ struct segment_header *mb_to_seg(struct wb_device *wb, struct metablock *mb)
 	return seg;
 }
 
-bool is_on_buffer(struct wb_device *wb, u32 mb_idx)
+/*
+ * True if the segment is open on any log head.
+ * The caller must pin the segment (nr_inflight_ios) beforehand.
+ */
+bool is_on_buffer(struct wb_device *wb, struct segment_header *seg)
 {
-	u32 start = wb->current_seg->start_idx;
-	if (mb_idx < start)
-		return false;
-
-	if (mb_idx >= (start + wb->nr_caches_inseg))
-		return false;
-
-	return true;
+	smp_mb();
+	return ACCESS_ONCE(seg->on_buffer);
 }
 
 static u32 segment_id_to_idx(struct wb_device *wb, u64 id)
@@ -167,6 +186,49 @@ struct segment_header *get_segment_header_by_id(struct wb_device *wb, u64 id)
 	return segment_at(wb, segment_id_to_idx(wb, id));
 }
 
+static sector_t sorted_sector(struct segment_header *seg, u32 k)
+{
+	return seg->mb_array[seg->mb_array[k].sorted_idx].sector;
+}
+
+static void sift_down_sorted_mbs(struct segment_header *seg, u32 nr, u32 i)
+{
+	u32 l;
+	while ((l = 2 * i + 1) < nr) {
+		u32 max = i;
+		if (sorted_sector(seg, l) > sorted_sector(seg, max))
+			max = l;
+		if (l + 1 < nr && sorted_sector(seg, l + 1) > sorted_sector(seg, max))
+			max = l + 1;
+		if (max == i)
+			return;
+		swap(seg->mb_array[i].sorted_idx, seg->mb_array[max].sorted_idx);
+		i = max;
+	}
+}
+
+/*
+ * Sort the metablocks of the segment in ascending order of the sector so the
+ * writeback daemon only has to merge the segments in a batch.
+ * mb_array[k].sorted_idx is the index of the metablock of the k-th smallest
+ * sector. The order is kept in the metablocks so heapsort sorts it in place.
+ */
+void sort_segment_mbs(struct segment_header *seg)
+{
+	u32 i;
+
+	for (i = 0; i < seg->length; i++)
+		seg->mb_array[i].sorted_idx = i;
+
+	for (i = seg->length / 2; i > 0; i--)
+		sift_down_sorted_mbs(seg, seg->length, i - 1);
+
+	for (i = seg->length; i > 1; i--) {
+		swap(seg->mb_array[0].sorted_idx, seg->mb_array[i - 1].sorted_idx);
+		sift_down_sorted_mbs(seg, i - 1, 0);
+	}
+}
+
 /*----------------------------------------------------------------------------*/
 
 static int init_segment_header_array(struct wb_device *wb)
@@ -188,10 +250,13 @@ static int init_segment_header_array(struct wb_device *wb)
 		seg->id = 0;
 		seg->length = 0;
 		atomic_set(&seg->nr_inflight_ios, 0);
+		seg->on_buffer = false;
+		seg->rambuf = NULL;
 
 		/* Const values */
 		seg->start_idx = wb->nr_caches_inseg * segment_idx;
 		seg->start_sector = calc_segment_header_start(wb, segment_idx);
+		seg->cache_dev = calc_segment_cache_dev(wb, segment_idx);
 	}
 
 	mb_array_empty_init(wb);
@@ -206,19 +271,26 @@ static void free_segment_header_array(struct wb_device *wb)
 
 /*----------------------------------------------------------------------------*/
 
+/*
+ * The buckets are hlist_nulls so the lookup can run under RCU. A metablock can
+ * move to another bucket while a reader traverses it and the nulls value at
+ * the end of the chain (the index of the bucket) tells the reader to restart.
+ * Metablocks are never freed so no grace period is needed.
+ */
 struct ht_head {
-	struct hlist_head ht_list;
+	struct hlist_nulls_head ht_list;
 };
 
+#define NR_HT_LOCKS 1024
+#define HT_LOCK_SHIFT 5
+
 static int ht_empty_init(struct wb_device *wb)
 {
-	u32 idx;
-	size_t i, nr_heads;
+	size_t i;
 	struct large_array *arr;
 
 	wb->htsize = wb->nr_caches;
-	nr_heads = wb->htsize + 1;
-	arr = large_array_alloc(sizeof(struct ht_head), nr_heads);
+	arr = large_array_alloc(sizeof(struct ht_head), wb->htsize);
 	if (!arr) {
 		DMERR("Failed to allocate htable");
 		return -ENOMEM;
@@ -226,23 +298,27 @@ static int ht_empty_init(struct wb_device *wb)
 
 	wb->htable = arr;
 
-	for (i = 0; i < nr_heads; i++) {
+	for (i = 0; i < wb->htsize; i++) {
 		struct ht_head *hd = large_array_at(arr, i);
-		INIT_HLIST_HEAD(&hd->ht_list);
+		INIT_HLIST_NULLS_HEAD(&hd->ht_list, i);
 	}
 
-	wb->null_head = large_array_at(wb->htable, wb->htsize);
-
-	for (idx = 0; idx < wb->nr_caches; idx++) {
-		struct metablock *mb = mb_at(wb, idx);
-		hlist_add_head(&mb->ht_list, &wb->null_head->ht_list);
+	wb->ht_locks = kmalloc(sizeof(struct mutex) * NR_HT_LOCKS, GFP_KERNEL);
+	if (!wb->ht_locks) {
+		DMERR("Failed to allocate ht_locks");
+		large_array_free(arr);
+		return -ENOMEM;
 	}
 
+	for (i = 0; i < NR_HT_LOCKS; i++)
+		mutex_init(wb->ht_locks + i);
+
 	return 0;
 }
 
 static void free_ht(struct wb_device *wb)
 {
+	kfree(wb->ht_locks);
 	large_array_free(wb->htable);
 }
 
@@ -253,63 +329,112 @@ struct ht_head *ht_get_head(struct wb_device *wb, struct lookup_key *key)
 	return large_array_at(wb->htable, idx);
 }
 
+/*
+ * Get the lock that protects the @head.
+ * All operations on the bucket must be done with this lock held.
+ *
+ * Neighboring buckets (thus neighboring 4KB blocks) share the lock so a bio
+ * spanning multiple blocks takes only a few locks.
+ */
+static size_t ht_idx(struct wb_device *wb, struct ht_head *head)
+{
+	return head - (struct ht_head *) wb->htable->data;
+}
+
+struct mutex *ht_get_lock(struct wb_device *wb, struct ht_head *head)
+{
+	return wb->ht_locks + ((ht_idx(wb, head) >> HT_LOCK_SHIFT) % NR_HT_LOCKS);
+}
+
 static bool mb_hit(struct metablock *mb, struct lookup_key *key)
 {
 	return mb->sector == key->sector;
 }
 
 /*
- * Remove the metablock from the hashtable and link the orphan to the null head.
+ * Remove the metablock from the hashtable. The orphan isn't linked anywhere.
  */
 void ht_del(struct wb_device *wb, struct metablock *mb)
 {
-	struct ht_head *null_head;
-
-	hlist_del(&mb->ht_list);
+	hlist_nulls_del_init_rcu(&mb->ht_list);
+}
 
-	null_head = wb->null_head;
-	hlist_add_head(&mb->ht_list, &null_head->ht_list);
+bool ht_hashed(struct metablock *mb)
+{
+	return !hlist_nulls_unhashed(&mb->ht_list);
 }
 
 void ht_register(struct wb_device *wb, struct ht_head *head,
 		 struct metablock *mb, struct lookup_key *key)
 {
-	hlist_del(&mb->ht_list);
-	hlist_add_head(&mb->ht_list, &head->ht_list);
+	hlist_nulls_del_init_rcu(&mb->ht_list);
 
 	BUG_ON(key->sector & 7); // should be 4KB aligned
 	mb->sector = key->sector;
+
+	/* Publish the metablock after the sector is set */
+	hlist_nulls_add_head_rcu(&mb->ht_list, &head->ht_list);
 };
 
+/*
+ * The caller must hold the lock of the lookup head or rcu_read_lock().
+ * Under RCU, the metablock found can be removed (and reused) anytime so the
+ * caller must validate it after pinning the segment (cf. cache_lookup_rcu()).
+ */
 struct metablock *ht_lookup(struct wb_device *wb, struct ht_head *head,
 			    struct lookup_key *key)
 {
-	struct metablock *mb, *found = NULL;
-	hlist_for_each_entry(mb, &head->ht_list, ht_list) {
-		if (mb_hit(mb, key)) {
-			found = mb;
-			break;
-		}
+	struct metablock *mb;
+	struct hlist_nulls_node *pos;
+
+retry:
+	hlist_nulls_for_each_entry_rcu(mb, pos, &head->ht_list, ht_list) {
+		if (mb_hit(mb, key))
+			return mb;
 	}
-	return found;
+
+	/* The traversal moved to another bucket */
+	if (get_nulls_value(pos) != ht_idx(wb, head))
+		goto retry;
+
+	return NULL;
 }
 
 /*
  * Remove all the metablock in the segment from the lookup table.
+ * The segment must not be open so no one registers its metablocks meanwhile.
  */
 void discard_caches_inseg(struct wb_device *wb, struct segment_header *seg)
 {
-	u8 i;
+	u32 i;
 	for (i = 0; i < wb->nr_caches_inseg; i++) {
 		struct metablock *mb = seg->mb_array + i;
+		struct lookup_key key;
+		struct mutex *lock;
+
+		if (!ht_hashed(mb))
+			continue;
+
+		key = (struct lookup_key) {
+			.sector = mb->sector,
+		};
+		lock = ht_get_lock(wb, ht_get_head(wb, &key));
+		mutex_lock(lock);
 		ht_del(wb, mb);
+		mutex_unlock(lock);
 	}
 }
 
 /*----------------------------------------------------------------------------*/
 
+static u32 calc_superblock_checksum(struct superblock_header_device *sup)
+{
+	size_t offset = offsetof(struct superblock_header_device, segment_size_order);
+	return ~crc32c(0xffffffff, (void *) sup + offset, sizeof(*sup) - offset);
+}
+
 static int read_superblock_header(struct superblock_header_device *sup,
-				  struct wb_device *wb)
+				  struct wb_device *wb, struct dm_dev *dev)
 {
 	int err = 0;
 	struct dm_io_request io_req_sup;
@@ -328,7 +453,7 @@ static int read_superblock_header(struct superblock_header_device *sup,
 		.mem.ptr.addr = buf,
 	};
 	region_sup = (struct dm_io_region) {
-		.bdev = wb->cache_dev->bdev,
+		.bdev = dev->bdev,
 		.sector = 0,
 		.count = 1,
 	};
@@ -343,6 +468,30 @@ bad_io:
 	return err;
 }
 
+/*
+ * The striped cache devices are formatted together and each one records its
+ * position in the stripe. They should be given in the same order on resume.
+ */
+static bool is_stripe_member(struct superblock_header_device *sup, struct wb_device *wb,
+			     u32 idx, u8 segment_size_order)
+{
+	u8 order = SEGMENT_SIZE_ORDER;
+	u32 nr_cache_devs = 1, cache_dev_idx = 0;
+
+	if (le32_to_cpu(sup->magic) != WB_MAGIC)
+		return false;
+
+	if (le32_to_cpu(sup->checksum) == calc_superblock_checksum(sup)) {
+		order = sup->segment_size_order;
+		nr_cache_devs = max_t(u32, sup->nr_cache_devs, 1);
+		cache_dev_idx = sup->cache_dev_idx;
+	}
+
+	return order == segment_size_order &&
+	       nr_cache_devs == wb->nr_cache_devs &&
+	       cache_dev_idx == idx;
+}
+
 /*
  * check if the cache device is already formatted.
  * returns 0 iff this routine runs without failure.
@@ -350,8 +499,10 @@ bad_io:
 static int audit_cache_device(struct wb_device *wb)
 {
 	int err = 0;
+	u8 segment_size_order;
+	u32 i;
 	struct superblock_header_device sup;
-	err = read_superblock_header(&sup, wb);
+	err = read_superblock_header(&sup, wb, wb->cache_devs[0]);
 	if (err) {
 		DMERR("read_superblock_header failed");
 		return err;
@@ -365,25 +516,63 @@ static int audit_cache_device(struct wb_device *wb)
 		return 0;
 	}
 
+	/*
+	 * The segment size is chosen at format time.
+	 * The cache device formatted by an older version has the default size.
+	 */
+	segment_size_order = SEGMENT_SIZE_ORDER;
+	if (le32_to_cpu(sup.checksum) == calc_superblock_checksum(&sup))
+		segment_size_order = sup.segment_size_order;
+
+	if (segment_size_order < 4 || segment_size_order > MAX_SEGMENT_SIZE_ORDER) {
+		DMERR("Superblock Header: Invalid segment_size_order %u", segment_size_order);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < wb->nr_cache_devs; i++) {
+		if (i) {
+			err = read_superblock_header(&sup, wb, wb->cache_devs[i]);
+			if (err) {
+				DMERR("read_superblock_header failed");
+				return err;
+			}
+		}
+		if (!is_stripe_member(&sup, wb, i, segment_size_order)) {
+			DMERR("Superblock Header: cache_dev %u isn't formatted as %u/%u of the stripe",
+			      i, i + 1, wb->nr_cache_devs);
+			return -EINVAL;
+		}
+	}
+
+	if (wb->segment_size_order_saved &&
+	    wb->segment_size_order_saved != segment_size_order)
+		DMWARN("segment_size_order %u is ignored. The cache device is formatted with %u",
+		       wb->segment_size_order_saved, segment_size_order);
+	wb->segment_size_order = segment_size_order;
+
 	return err;
 }
 
-static int format_superblock_header(struct wb_device *wb)
+static int format_superblock_header(struct wb_device *wb, u32 idx)
 {
 	int err = 0;
 
 	struct dm_io_request io_req_sup;
 	struct dm_io_region region_sup;
 
-	struct superblock_header_device sup = {
-		.magic = cpu_to_le32(WB_MAGIC),
-	};
+	struct superblock_header_device *sup;
 
 	void *buf = mempool_alloc(wb->buf_1_pool, GFP_KERNEL);
 	if (!buf)
 		return -ENOMEM;
 
-	memcpy(buf, &sup, sizeof(sup));
+	memset(buf, 0, 1 << 9);
+	sup = buf;
+	sup->magic = cpu_to_le32(WB_MAGIC);
+	sup->segment_size_order = wb->segment_size_order;
+	sup->nr_cache_devs = wb->nr_cache_devs;
+	sup->cache_dev_idx = idx;
+	sup->checksum = cpu_to_le32(calc_superblock_checksum(sup));
 
 	io_req_sup = (struct dm_io_request) {
 		WB_IO_WRITE_FUA,
@@ -393,7 +582,7 @@ static int format_superblock_header(struct wb_device *wb)
 		.mem.ptr.addr = buf,
 	};
 	region_sup = (struct dm_io_region) {
-		.bdev = wb->cache_dev->bdev,
+		.bdev = wb->cache_devs[idx]->bdev,
 		.sector = 0,
 		.count = 1,
 	};
@@ -448,10 +637,10 @@ static int do_zeroing_region(struct wb_device *wb, struct dm_io_region *region)
 	return zc.error;
 }
 
-static int zeroing_full_superblock(struct wb_device *wb)
+static int zeroing_full_superblock(struct wb_device *wb, u32 idx)
 {
 	struct dm_io_region region = {
-		.bdev = wb->cache_dev->bdev,
+		.bdev = wb->cache_devs[idx]->bdev,
 		.sector = 0,
 		.count = 1 << 11,
 	};
@@ -461,7 +650,6 @@ static int zeroing_full_superblock(struct wb_device *wb)
 static int format_all_segment_headers(struct wb_device *wb)
 {
 	int err = 0;
-	struct dm_dev *dev = wb->cache_dev;
 	u32 i;
 
 	struct format_segmd_context context;
@@ -486,7 +674,7 @@ static int format_all_segment_headers(struct wb_device *wb)
 			.mem.ptr.addr = buf,
 		};
 		struct dm_io_region region_seg = {
-			.bdev = dev->bdev,
+			.bdev = calc_segment_cache_dev(wb, i)->bdev,
 			.sector = calc_segment_header_start(wb, i),
 			.count = (1 << 3),
 		};
@@ -508,7 +696,7 @@ static int format_all_segment_headers(struct wb_device *wb)
 		goto bad;
 	}
 
-	err = blkdev_issue_flush(dev->bdev, GFP_KERNEL, NULL);
+	err = flush_cache_devices(wb);
 
 bad:
 	mempool_free(buf, wb->buf_8_pool);
@@ -520,27 +708,34 @@ bad:
  */
 static int format_cache_device(struct wb_device *wb)
 {
-	int err = zeroing_full_superblock(wb);
-	if (err) {
-		DMERR("zeroing_full_superblock failed");
-		return err;
+	int err = 0;
+	u32 i;
+
+	for (i = 0; i < wb->nr_cache_devs; i++) {
+		err = zeroing_full_superblock(wb, i);
+		if (err) {
+			DMERR("zeroing_full_superblock failed");
+			return err;
+		}
 	}
 	err = format_all_segment_headers(wb);
 	if (err) {
 		DMERR("format_all_segment_headers failed");
 		return err;
 	}
-	err = format_superblock_header(wb); /* First 512B */
-	if (err) {
-		DMERR("format_superblock_header failed");
-		return err;
+	/* The first cache device is formatted last. It marks the completion */
+	for (i = wb->nr_cache_devs; i > 0; i--) {
+		err = format_superblock_header(wb, i - 1); /* First 512B */
+		if (err) {
+			DMERR("format_superblock_header failed");
+			return err;
+		}
 	}
 	return err;
 }
 
 /*
- * First check if the superblock and the passed arguments are consistent and
- * re-format the cache structure if they are not.
+ * Format the cache device if audit_cache_device() found it's not formatted.
  * If you want to re-format the cache device you must zeroes out the first one
  * sector of the device.
  */
@@ -548,12 +743,6 @@ static int might_format_cache_device(struct wb_device *wb)
 {
 	int err = 0;
 
-	err = audit_cache_device(wb);
-	if (err) {
-		DMERR("audit_cache_device failed");
-		return err;
-	}
-
 	if (wb->do_format) {
 		err = format_cache_device(wb);
 		if (err) {
@@ -567,49 +756,211 @@ static int might_format_cache_device(struct wb_device *wb)
 
 /*----------------------------------------------------------------------------*/
 
-static int init_rambuf_pool(struct wb_device *wb)
+/*
+ * The pages of the RAM buffer are listed to write the adjacent segments in
+ * one I/O (cf. submit_segments). The segment should be page-aligned.
+ */
+static int map_rambuffer_pages(struct wb_device *wb, struct rambuffer *rambuf, gfp_t gfp)
 {
-	int err = 0;
-	size_t i;
+	size_t i, nr_pages = (1 << (wb->segment_size_order + 9)) >> PAGE_SHIFT;
 
-	wb->rambuf_pool = kmalloc(sizeof(struct rambuffer) * NR_RAMBUF_POOL, GFP_KERNEL);
-	if (!wb->rambuf_pool)
+	rambuf->pages = NULL;
+	if (!nr_pages || (1 << (wb->segment_size_order + 9)) & ~PAGE_MASK)
+		return 0;
+
+	rambuf->pages = kmalloc(sizeof(struct page_list) * nr_pages, gfp);
+	if (!rambuf->pages)
 		return -ENOMEM;
 
-	for (i = 0; i < NR_RAMBUF_POOL; i++) {
-		void *alloced = vmalloc(1 << (SEGMENT_SIZE_ORDER + 9));
-		if (!alloced) {
-			size_t j;
-			DMERR("Failed to allocate rambuf->data");
-			for (j = 0; j < i; j++) {
-				vfree(wb->rambuf_pool[j].data);
-			}
-			err = -ENOMEM;
-			goto bad_alloc_data;
-		}
-		wb->rambuf_pool[i].data = alloced;
+	for (i = 0; i < nr_pages; i++) {
+		rambuf->pages[i].page = vmalloc_to_page(rambuf->data + (i << PAGE_SHIFT));
+		rambuf->pages[i].next = rambuf->pages + i + 1;
 	}
+	rambuf->pages[nr_pages - 1].next = NULL;
+	return 0;
+}
 
-	return err;
+static struct rambuffer *alloc_rambuffer(struct wb_device *wb, gfp_t gfp)
+{
+	struct rambuffer *rambuf = kmalloc(sizeof(*rambuf), gfp);
+	if (!rambuf)
+		return NULL;
 
-bad_alloc_data:
-	kfree(wb->rambuf_pool);
-	return err;
+	rambuf->data = __vmalloc(1 << (wb->segment_size_order + 9), gfp, PAGE_KERNEL);
+	if (!rambuf->data)
+		goto bad_data;
+
+	if (map_rambuffer_pages(wb, rambuf, gfp))
+		goto bad_pages;
+
+	rambuf->wb = wb;
+	rambuf->seg = NULL;
+	return rambuf;
+
+bad_pages:
+	vfree(rambuf->data);
+bad_data:
+	kfree(rambuf);
+	return NULL;
+}
+
+static void free_rambuffer(struct rambuffer *rambuf)
+{
+	kfree(rambuf->pages);
+	vfree(rambuf->data);
+	kfree(rambuf);
+}
+
+/*
+ * A log head sealing its segment needs a new RAM buffer while the segment is
+ * flushed. The pool must be larger than the number of log heads otherwise the
+ * open segments can block each other.
+ */
+static u32 calc_nr_rambuf_pool(struct wb_device *wb)
+{
+	return max_t(u32, ACCESS_ONCE(wb->nr_rambuf_pool), 2 * wb->nr_log_heads);
 }
 
 static void free_rambuf_pool(struct wb_device *wb)
 {
-	size_t i;
-	for (i = 0; i < NR_RAMBUF_POOL; i++)
-		vfree(wb->rambuf_pool[i].data);
-	kfree(wb->rambuf_pool);
+	struct rambuffer *rambuf, *tmp;
+	u32 i;
+
+	list_for_each_entry_safe(rambuf, tmp, &wb->rambuf_free_list, list) {
+		list_del(&rambuf->list);
+		free_rambuffer(rambuf);
+	}
+
+	/* The segments still open weren't flushed */
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct log_head *head = wb->log_heads + i;
+		if (head->current_rambuf)
+			free_rambuffer(head->current_rambuf);
+	}
 }
 
-struct rambuffer *get_rambuffer_by_id(struct wb_device *wb, u64 id)
+static int init_rambuf_pool(struct wb_device *wb)
 {
-	u32 tmp32;
-	div_u64_rem(id - 1, NR_RAMBUF_POOL, &tmp32);
-	return wb->rambuf_pool + tmp32;
+	u32 i, nr_rambuf_pool = calc_nr_rambuf_pool(wb);
+
+	spin_lock_init(&wb->rambuf_lock);
+	INIT_LIST_HEAD(&wb->rambuf_free_list);
+	init_waitqueue_head(&wb->rambuf_wait_queue);
+
+	wb->nr_cur_rambuf_pool = 0;
+	for (i = 0; i < nr_rambuf_pool; i++) {
+		struct rambuffer *rambuf = alloc_rambuffer(wb, GFP_KERNEL);
+		if (!rambuf) {
+			DMERR("Failed to allocate rambuf");
+			free_rambuf_pool(wb);
+			return -ENOMEM;
+		}
+		list_add(&rambuf->list, &wb->rambuf_free_list);
+		wb->nr_cur_rambuf_pool++;
+	}
+
+	return 0;
+}
+
+/*
+ * Take a RAM buffer from the free list. If the list is empty the pool grows
+ * unless it reached the limit. Returns NULL if no RAM buffer is available.
+ */
+struct rambuffer *get_free_rambuffer(struct wb_device *wb)
+{
+	struct rambuffer *rambuf = NULL;
+	bool grow;
+
+	spin_lock(&wb->rambuf_lock);
+	if (!list_empty(&wb->rambuf_free_list)) {
+		rambuf = list_first_entry(&wb->rambuf_free_list, struct rambuffer, list);
+		list_del(&rambuf->list);
+	}
+	grow = !rambuf &&
+	       wb->nr_cur_rambuf_pool < RAMBUF_POOL_GROWTH * calc_nr_rambuf_pool(wb);
+	if (grow)
+		wb->nr_cur_rambuf_pool++;
+	spin_unlock(&wb->rambuf_lock);
+
+	if (grow) {
+		/*
+		 * The caller may hold a log head lock. __vmalloc() allocates
+		 * the page tables with GFP_KERNEL regardless of the gfp mask
+		 * so the reclaim must be kept from issuing I/O in the scope.
+		 */
+		unsigned int noio_flag = memalloc_noio_save();
+		rambuf = alloc_rambuffer(wb, GFP_NOIO | __GFP_NOWARN);
+		memalloc_noio_restore(noio_flag);
+		if (!rambuf) {
+			spin_lock(&wb->rambuf_lock);
+			wb->nr_cur_rambuf_pool--;
+			spin_unlock(&wb->rambuf_lock);
+		}
+	}
+
+	return rambuf;
+}
+
+void put_rambuffer(struct wb_device *wb, struct rambuffer *rambuf)
+{
+	spin_lock(&wb->rambuf_lock);
+	list_add(&rambuf->list, &wb->rambuf_free_list);
+	spin_unlock(&wb->rambuf_lock);
+	wake_up(&wb->rambuf_wait_queue);
+}
+
+bool has_free_rambuffer(struct wb_device *wb)
+{
+	return !list_empty_careful(&wb->rambuf_free_list);
+}
+
+/*
+ * Free the RAM buffers allocated over nr_rambuf_pool.
+ */
+void shrink_rambuf_pool(struct wb_device *wb)
+{
+	while (true) {
+		struct rambuffer *rambuf = NULL;
+
+		spin_lock(&wb->rambuf_lock);
+		if (wb->nr_cur_rambuf_pool > calc_nr_rambuf_pool(wb) &&
+		    !list_empty(&wb->rambuf_free_list)) {
+			rambuf = list_first_entry(&wb->rambuf_free_list, struct rambuffer, list);
+			list_del(&rambuf->list);
+			wb->nr_cur_rambuf_pool--;
+		}
+		spin_unlock(&wb->rambuf_lock);
+
+		if (!rambuf)
+			break;
+		free_rambuffer(rambuf);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int init_log_heads(struct wb_device *wb)
+{
+	u32 i;
+
+	wb->log_heads = kmalloc(sizeof(struct log_head) * wb->nr_log_heads, GFP_KERNEL);
+	if (!wb->log_heads)
+		return -ENOMEM;
+
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct log_head *head = wb->log_heads + i;
+		mutex_init(&head->lock);
+		head->cursor = 0;
+		head->current_seg = NULL;
+		head->current_rambuf = NULL;
+	}
+
+	return 0;
+}
+
+static void free_log_heads(struct wb_device *wb)
+{
+	kfree(wb->log_heads);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -617,6 +968,7 @@ struct rambuffer *get_rambuffer_by_id(struct wb_device *wb, u64 id)
 /*
  * Initialize core devices
  * - Cache device (SSD)
+ * - Log heads
  * - RAM buffers (DRAM)
  */
 static int init_devices(struct wb_device *wb)
@@ -627,9 +979,16 @@ static int init_devices(struct wb_device *wb)
 	if (err)
 		return err;
 
+	err = init_log_heads(wb);
+	if (err) {
+		DMERR("init_log_heads failed");
+		return err;
+	}
+
 	err = init_rambuf_pool(wb);
 	if (err) {
 		DMERR("init_rambuf_pool failed");
+		free_log_heads(wb);
 		return err;
 	}
 
@@ -639,6 +998,7 @@ static int init_devices(struct wb_device *wb)
 static void free_devices(struct wb_device *wb)
 {
 	free_rambuf_pool(wb);
+	free_log_heads(wb);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -664,7 +1024,7 @@ static int read_superblock_record(struct superblock_record_device *record,
 		.mem.ptr.addr = buf,
 	};
 	region = (struct dm_io_region) {
-		.bdev = wb->cache_dev->bdev,
+		.bdev = wb->cache_devs[0]->bdev,
 		.sector = (1 << 11) - 1,
 		.count = 1,
 	};
@@ -693,9 +1053,9 @@ static int read_whole_segment(void *buf, struct wb_device *wb,
 		.mem.ptr.addr = buf,
 	};
 	struct dm_io_region region = {
-		.bdev = wb->cache_dev->bdev,
+		.bdev = seg->cache_dev->bdev,
 		.sector = seg->start_sector,
-		.count = 1 << SEGMENT_SIZE_ORDER,
+		.count = 1 << wb->segment_size_order,
 	};
 	return wb_io(&io_req, 1, &region, NULL, false);
 }
@@ -704,32 +1064,108 @@ static int read_whole_segment(void *buf, struct wb_device *wb,
  * We make a checksum of a segment from the valid data in a segment except the
  * first 1 sector.
  */
-u32 calc_checksum(void *rambuffer, u8 length)
+u32 calc_checksum(struct wb_device *wb, void *rambuffer, u32 length)
 {
-	unsigned int len = (4096 - 512) + 4096 * length;
+	unsigned int len = ((wb->nr_header_blocks + length) << 12) - 512;
 	return ~crc32c(0xffffffff, rambuffer + 512, len);
 }
 
+/*
+ * We make a checksum of a chunk from the metablock_devices and the data of the
+ * metablocks [@from, @to).
+ */
+static u32 calc_chunk_checksum(struct wb_device *wb, void *rambuffer, u32 from, u32 to)
+{
+	struct segment_header_device *header = rambuffer;
+	u32 crc = crc32c(0xffffffff, header->mbarr + from,
+			 (to - from) * sizeof(struct metablock_device));
+	crc = crc32c(crc, rambuffer + ((wb->nr_header_blocks + from) << 12),
+		     (to - from) << 12);
+	return ~crc;
+}
+
+static void prepare_metablock_devices(struct wb_device *wb, struct segment_header_device *dest,
+				      struct segment_header *src, u32 from, u32 to)
+{
+	u32 i;
+	for (i = from; i < to; i++) {
+		struct metablock *mb = src->mb_array + i;
+		struct metablock_device *mbdev = dest->mbarr + i;
+		struct dirtiness dirtiness = read_mb_dirtiness(wb, src, mb);
+
+		/*
+		 * A metablock can be overwritten after it's committed (cf.
+		 * is_frozen_mb()) or the segment is sealed because the header
+		 * is prepared by the flush daemon. It was dirty and is recorded
+		 * so because the newer data may not be replayed. Pairs with
+		 * prepare_overwrite() that unhashes it first.
+		 */
+		mbdev->sector = cpu_to_le64((u64)mb->sector);
+		mbdev->dirty_bits = (dirtiness.is_dirty || !ht_hashed(mb)) ? dirtiness.data_bits : 0;
+	}
+}
+
 void prepare_segment_header_device(void *rambuffer,
 				   struct wb_device *wb,
 				   struct segment_header *src)
 {
 	struct segment_header_device *dest = rambuffer;
-	u32 i;
 
-	ASSERT((src->length) == (wb->cursor - src->start_idx));
+	prepare_metablock_devices(wb, dest, src, 0, src->length);
 
-	for (i = 0; i < src->length; i++) {
-		struct metablock *mb = src->mb_array + i;
-		struct metablock_device *mbdev = dest->mbarr + i;
+	dest->id = cpu_to_le64(src->id);
+	dest->length = cpu_to_le16(src->length);
+	dest->checksum = cpu_to_le32(calc_checksum(wb, rambuffer, src->length));
+}
 
-		mbdev->sector = cpu_to_le64((u64)mb->sector);
-		mbdev->dirty_bits = mb->dirtiness.is_dirty ? mb->dirtiness.data_bits : 0;
+/*
+ * Prepare the segment header to commit the metablocks [@from, @to) as a new
+ * chunk. The metablocks before @from are committed already and their part of
+ * the header is kept as is so the checksums of the preceding chunks stay valid.
+ * The checksum of the whole segment is also updated so the old drivers can
+ * read the segment as long as it's not torn.
+ */
+void prepare_segment_chunk_device(void *rambuffer, struct wb_device *wb,
+				  struct segment_header *src, u32 from, u32 to)
+{
+	struct segment_header_device *dest = rambuffer;
+
+	if (to > from) {
+		struct segment_chunk_device *chunk = dest->chunks + dest->nr_chunks;
+
+		prepare_metablock_devices(wb, dest, src, from, to);
+		chunk->length = cpu_to_le16(to);
+		chunk->checksum = cpu_to_le32(calc_chunk_checksum(wb, rambuffer, from, to));
+		dest->nr_chunks++;
 	}
 
 	dest->id = cpu_to_le64(src->id);
-	dest->length = src->length;
-	dest->checksum = cpu_to_le32(calc_checksum(rambuffer, src->length));
+	dest->length = cpu_to_le16(to);
+	dest->checksum = cpu_to_le32(calc_checksum(wb, rambuffer, to));
+}
+
+/*
+ * Returns the length of the valid prefix of the segment committed
+ * incrementally. The chunks are validated in order.
+ */
+static u32 calc_valid_chunks_length(struct wb_device *wb, void *rambuffer)
+{
+	struct segment_header_device *header = rambuffer;
+	u32 i, from = 0;
+
+	if (header->nr_chunks > NR_MAX_SEG_CHUNKS)
+		return 0;
+
+	for (i = 0; i < header->nr_chunks; i++) {
+		struct segment_chunk_device *chunk = header->chunks + i;
+		u32 to = le16_to_cpu(chunk->length);
+		if (to <= from || to > wb->nr_caches_inseg)
+			break;
+		if (calc_chunk_checksum(wb, rambuffer, from, to) != le32_to_cpu(chunk->checksum))
+			break;
+		from = to;
+	}
+	return from;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -738,7 +1174,7 @@ void prepare_segment_header_device(void *rambuffer,
  * Apply @i-th metablock in @src to @seg
  */
 static int apply_metablock_device(struct wb_device *wb, struct segment_header *seg,
-				  struct segment_header_device *src, u8 i)
+				  struct segment_header_device *src, u32 i)
 {
 	struct lookup_key key;
 	struct ht_head *head;
@@ -758,23 +1194,28 @@ static int apply_metablock_device(struct wb_device *wb, struct segment_header *s
 	if (found) {
 		int err = 0;
 		u8 i;
-		struct write_io wio;
-		void *buf = mempool_alloc(wb->buf_8_pool, GFP_KERNEL);
-		if (!buf)
-			return -ENOMEM;
+		struct segment_header *found_seg = mb_to_seg(wb, found);
+		struct dirtiness dirtiness = read_mb_dirtiness(wb, found_seg, found);
+		void *buf = NULL;
 
-		wio = (struct write_io) {
-			.data = buf,
-			.data_bits = 0,
-		};
-		err = prepare_overwrite(wb, mb_to_seg(wb, found), found, &wio, mb->dirtiness.data_bits);
-		if (err)
-			goto fail_out;
+		/*
+		 * The old dirty data not overwritten entirely is written back
+		 * before the old cache is dropped.
+		 */
+		if (dirtiness.is_dirty && mb->dirtiness.data_bits != 255) {
+			buf = read_mb(wb, found_seg, found, dirtiness.data_bits);
+			if (!buf)
+				return -EIO;
+		}
+
+		prepare_overwrite(wb, found);
+		if (!buf)
+			goto register_mb;
 
 		for (i = 0; i < 8; i++) {
 			struct dm_io_request io_req;
 			struct dm_io_region region;
-			if (!(wio.data_bits & (1 << i)))
+			if (!(dirtiness.data_bits & (1 << i)))
 				continue;
 
 			io_req = (struct dm_io_request) {
@@ -782,7 +1223,7 @@ static int apply_metablock_device(struct wb_device *wb, struct segment_header *s
 				.client = wb->io_client,
 				.notify.fn = NULL,
 				.mem.type = DM_IO_KMEM,
-				.mem.ptr.addr = wio.data + (i << 9),
+				.mem.ptr.addr = buf + (i << 9),
 			};
 			region = (struct dm_io_region) {
 				.bdev = wb->backing_dev->bdev,
@@ -794,12 +1235,12 @@ static int apply_metablock_device(struct wb_device *wb, struct segment_header *s
 				break;
 		}
 
-fail_out:
 		mempool_free(buf, wb->buf_8_pool);
 		if (err)
 			return err;
 	}
 
+register_mb:
 	ht_register(wb, head, mb, &key);
 
 	if (mb->dirtiness.is_dirty)
@@ -812,14 +1253,15 @@ static int apply_segment_header_device(struct wb_device *wb, struct segment_head
 				       struct segment_header_device *src)
 {
 	int err = 0;
-	u8 i;
-	seg->length = src->length;
-	for (i = 0; i < src->length; i++) {
+	u32 i;
+	seg->length = le16_to_cpu(src->length);
+	for (i = 0; i < seg->length; i++) {
 		err = apply_metablock_device(wb, seg, src, i);
 		if (err)
-			break;
+			return err;
 	}
-	return err;
+	sort_segment_mbs(seg);
+	return 0;
 }
 
 /*
@@ -836,7 +1278,7 @@ static int read_segment_header(void *buf, struct wb_device *wb,
 		.mem.ptr.addr = buf,
 	};
 	struct dm_io_region region = {
-		.bdev = wb->cache_dev->bdev,
+		.bdev = seg->cache_dev->bdev,
 		.sector = seg->start_sector,
 		.count = 8,
 	};
@@ -898,15 +1340,20 @@ static int find_max_id(struct wb_device *wb, u64 *max_id)
  * @max_id (in/out)
  *   - in  : The max id found in find_max_id()
  *   - out : The last id applied in this function
+ * @record_id
+ *   The segments up to this id were written back and their caches may
+ *   be stale because the blocks can be written to the backing device
+ *   directly afterward (cf. process_write_bypass()). They are validated
+ *   but not applied.
  */
-static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id)
+static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id, u64 record_id)
 {
 	int err = 0;
 	struct segment_header *seg;
 	struct segment_header_device *header;
 	u32 i, start_idx;
 
-	void *rambuf = vmalloc(1 << (SEGMENT_SIZE_ORDER + 9));
+	void *rambuf = vmalloc(1 << (wb->segment_size_order + 9));
 	if (!rambuf)
 		return -ENOMEM;
 
@@ -918,7 +1365,7 @@ static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id)
 	*max_id = 0;
 
 	for (i = start_idx; i < (start_idx + wb->nr_segments); i++) {
-		u32 actual, expected, k;
+		u32 actual, expected, length, k;
 		div_u64_rem(i, wb->nr_segments, &k);
 		seg = segment_at(wb, k);
 
@@ -941,19 +1388,41 @@ static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id)
 		 * Compare the checksum
 		 * if they don't match we discard the subsequent logs.
 		 */
-		actual = calc_checksum(rambuf, header->length);
+		length = le16_to_cpu(header->length);
+		if (length > wb->nr_caches_inseg) {
+			DMWARN("Length invalid id:%llu length: %u",
+			       (long long unsigned int) le64_to_cpu(header->id),
+			       length);
+			break;
+		}
+		actual = calc_checksum(wb, rambuf, length);
 		expected = le32_to_cpu(header->checksum);
 		if (actual != expected) {
-			DMWARN("Checksum incorrect id:%llu checksum: %u != %u",
+			/*
+			 * The last commit of the segment committed
+			 * incrementally may be torn. The committed prefix
+			 * is still valid and no later segment was written
+			 * before the crash.
+			 */
+			u32 valid_length = calc_valid_chunks_length(wb, rambuf);
+			if (!valid_length) {
+				DMWARN("Checksum incorrect id:%llu checksum: %u != %u",
+				       (long long unsigned int) le64_to_cpu(header->id),
+				       actual, expected);
+				break;
+			}
+			DMWARN("Segment partially valid id:%llu length: %u/%u",
 			       (long long unsigned int) le64_to_cpu(header->id),
-			       actual, expected);
-			break;
+			       valid_length, length);
+			header->length = cpu_to_le16(valid_length);
 		}
 
 		/* This segment is correct and we apply */
-		err = apply_segment_header_device(wb, seg, header);
-		if (err)
-			break;
+		if (le64_to_cpu(header->id) > record_id) {
+			err = apply_segment_header_device(wb, seg, header);
+			if (err)
+				break;
+		}
 
 		*max_id = le64_to_cpu(header->id);
 	}
@@ -962,7 +1431,7 @@ static int do_apply_valid_segments(struct wb_device *wb, u64 *max_id)
 	return err;
 }
 
-static int apply_valid_segments(struct wb_device *wb, u64 *max_id)
+static int apply_valid_segments(struct wb_device *wb, u64 *max_id, u64 record_id)
 {
 	/*
 	 * Fast path.
@@ -972,22 +1441,12 @@ static int apply_valid_segments(struct wb_device *wb, u64 *max_id)
 	if (!(*max_id))
 		return 0;
 
-	return do_apply_valid_segments(wb, max_id);
+	return do_apply_valid_segments(wb, max_id, record_id);
 }
 
-static int infer_last_writeback_id(struct wb_device *wb)
+static void infer_last_writeback_id(struct wb_device *wb, u64 record_id)
 {
-	int err = 0;
-
-	u64 inferred_last_writeback_id;
-	u64 record_id;
-
-	struct superblock_record_device uninitialized_var(record);
-	err = read_superblock_record(&record, wb);
-	if (err)
-		return err;
-
-	inferred_last_writeback_id =
+	u64 inferred_last_writeback_id =
 		SUB_ID(atomic64_read(&wb->last_flushed_segment_id), wb->nr_segments);
 
 	/*
@@ -995,7 +1454,6 @@ static int infer_last_writeback_id(struct wb_device *wb)
 	 * we can eliminate unnecessary writeback for the segments that were
 	 * written back before.
 	 */
-	record_id = le64_to_cpu(record.last_writeback_segment_id);
 	if (record_id > inferred_last_writeback_id) {
 		u64 id;
 		for (id = inferred_last_writeback_id + 1; id <= record_id; id++)
@@ -1004,7 +1462,7 @@ static int infer_last_writeback_id(struct wb_device *wb)
 	}
 
 	atomic64_set(&wb->last_writeback_segment_id, inferred_last_writeback_id);
-	return err;
+	atomic64_set(&wb->last_recorded_segment_id, record_id);
 }
 
 /*
@@ -1014,6 +1472,7 @@ static int infer_last_writeback_id(struct wb_device *wb)
  * 1. Find the maximum id
  * 2. Start from the right. iterate all the log.
  * 2. Skip if id=0 or checkum incorrect
+ * 2. Skip applying if the segment was recorded as written back
  * 2. Apply otherwise.
  *
  * This algorithm is robust for floppy SSD that may write a segment partially
@@ -1023,14 +1482,23 @@ static int replay_log_on_cache(struct wb_device *wb)
 {
 	int err = 0;
 
-	u64 max_id;
+	u64 max_id, record_id;
+	struct superblock_record_device uninitialized_var(record);
+
 	err = find_max_id(wb, &max_id);
 	if (err) {
 		DMERR("find_max_id failed");
 		return err;
 	}
 
-	err = apply_valid_segments(wb, &max_id);
+	err = read_superblock_record(&record, wb);
+	if (err) {
+		DMERR("read_superblock_record failed");
+		return err;
+	}
+	record_id = le64_to_cpu(record.last_writeback_segment_id);
+
+	err = apply_valid_segments(wb, &max_id, record_id);
 	if (err) {
 		DMERR("apply_valid_segments failed");
 		return err;
@@ -1038,28 +1506,23 @@ static int replay_log_on_cache(struct wb_device *wb)
 
 	/* Setup last_flushed_segment_id */
 	atomic64_set(&wb->last_flushed_segment_id, max_id);
+	wb->last_submitted_segment_id = max_id;
 
 	/* Setup last_queued_segment_id */
 	atomic64_set(&wb->last_queued_segment_id, max_id);
 
+	/* Setup last_allocated_segment_id */
+	atomic64_set(&wb->last_allocated_segment_id, max_id);
+
 	/* Setup last_writeback_segment_id */
-	infer_last_writeback_id(wb);
+	infer_last_writeback_id(wb, record_id);
 
 	return err;
 }
 
 /*
- * Acquire and initialize the first segment header for our caching.
- */
-static void prepare_first_seg(struct wb_device *wb)
-{
-	u64 init_segment_id = atomic64_read(&wb->last_flushed_segment_id) + 1;
-	acquire_new_seg(wb, init_segment_id);
-	cursor_init(wb);
-}
-
-/*
- * Recover all the cache state from the persistent devices
+ * Recover all the cache state from the persistent devices.
+ * The log heads open their first segments lazily on the first write.
  */
 static int recover_cache(struct wb_device *wb)
 {
@@ -1071,7 +1534,6 @@ static int recover_cache(struct wb_device *wb)
 		return err;
 	}
 
-	prepare_first_seg(wb);
 	return 0;
 }
 
@@ -1079,7 +1541,7 @@ static int recover_cache(struct wb_device *wb)
 
 static struct writeback_segment *alloc_writeback_segment(struct wb_device *wb, gfp_t gfp)
 {
-	u8 i;
+	u32 i;
 
 	struct writeback_segment *writeback_seg = kmalloc(sizeof(*writeback_seg), gfp);
 	if (!writeback_seg)
@@ -1089,7 +1551,7 @@ static struct writeback_segment *alloc_writeback_segment(struct wb_device *wb, g
 	if (!writeback_seg->ios)
 		goto bad_ios;
 
-	writeback_seg->buf = vmalloc((1 << (SEGMENT_SIZE_ORDER + 9)) - (1 << 12));
+	writeback_seg->buf = vmalloc(wb->nr_caches_inseg << 12);
 	if (!writeback_seg->buf)
 		goto bad_buf;
 
@@ -1125,9 +1587,10 @@ static void free_writeback_segment(struct wb_device *wb, struct writeback_segmen
 static void free_writeback_ios(struct wb_device *wb)
 {
 	size_t i;
-	for (i = 0; i < wb->nr_cur_batched_writeback; i++)
+	for (i = 0; i < 2 * wb->nr_writeback_segs; i++)
 		free_writeback_segment(wb, *(wb->writeback_segs + i));
 	kfree(wb->writeback_segs);
+	kfree(wb->writeback_heap);
 }
 
 /*
@@ -1139,18 +1602,28 @@ int try_alloc_writeback_ios(struct wb_device *wb, size_t nr_batch, gfp_t gfp)
 	int err = 0;
 	size_t i;
 
+	struct writeback_segment **writeback_heap;
+
+	/* The second half is for the read-ahead (cf. prefetch_writeback_segs) */
 	struct writeback_segment **writeback_segs = kzalloc(
-			nr_batch * sizeof(struct writeback_segment *), gfp);
+			2 * nr_batch * sizeof(struct writeback_segment *), gfp);
 	if (!writeback_segs)
 		return -ENOMEM;
 
-	for (i = 0; i < nr_batch; i++) {
+	writeback_heap = kmalloc(nr_batch * sizeof(struct writeback_segment *), gfp);
+	if (!writeback_heap) {
+		kfree(writeback_segs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < 2 * nr_batch; i++) {
 		struct writeback_segment *alloced = alloc_writeback_segment(wb, gfp);
 		if (!alloced) {
 			size_t j;
 			for (j = 0; j < i; j++)
 				free_writeback_segment(wb, writeback_segs[j]);
 			kfree(writeback_segs);
+			kfree(writeback_heap);
 
 			DMERR("Failed to allocate writeback_segs");
 			return -ENOMEM;
@@ -1167,7 +1640,9 @@ int try_alloc_writeback_ios(struct wb_device *wb, size_t nr_batch, gfp_t gfp)
 
 	/* And then swap by new values */
 	wb->writeback_segs = writeback_segs;
+	wb->writeback_heap = writeback_heap;
 	wb->nr_writeback_segs = nr_batch;
+	wb->nr_prefetched_writeback = 0;
 
 	return err;
 }
@@ -1232,6 +1707,7 @@ static int init_writeback_daemon(struct wb_device *wb)
 
 	atomic_set(&wb->writeback_fail_count, 0);
 	atomic_set(&wb->writeback_io_count, 0);
+	wb->writeback_sweep = 0;
 
 	nr_batch = 32;
 	wb->nr_max_batched_writeback = nr_batch;
@@ -1272,8 +1748,16 @@ static int init_flush_barrier_work(struct wb_device *wb)
 		DMERR("Failed to allocate barrier_wq");
 		return -ENOMEM;
 	}
+	spin_lock_init(&wb->barrier_lock);
 	bio_list_init(&wb->barrier_ios);
+	wb->barrier_id = 0;
 	INIT_WORK(&wb->flush_barrier_work, flush_barrier_ios);
+	bio_list_init(&wb->fua_ios);
+	wb->fua_id = 0;
+	INIT_WORK(&wb->flush_fua_work, flush_fua_ios);
+	hrtimer_init(&wb->barrier_deadline_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	wb->barrier_deadline_timer.function = barrier_deadline_proc;
+	wb->barrier_deadline_armed = false;
 	return 0;
 }
 
@@ -1314,8 +1798,23 @@ int resume_cache(struct wb_device *wb)
 {
 	int err = 0;
 
-	wb->nr_segments = calc_nr_segments(wb->cache_dev, wb);
-	wb->nr_caches_inseg = (1 << (SEGMENT_SIZE_ORDER - 3)) - 1;
+	u32 nr_blocks_inseg;
+
+	err = audit_cache_device(wb);
+	if (err) {
+		DMERR("audit_cache_device failed");
+		return err;
+	}
+
+	/*
+	 * The segment header (512B + 16B per metablock) occupies the first
+	 * 4KB blocks of a segment and the rest are for the data.
+	 */
+	nr_blocks_inseg = 1 << (wb->segment_size_order - 3);
+	wb->nr_header_blocks = DIV_ROUND_UP(512 + sizeof(struct metablock_device) * nr_blocks_inseg, 1 << 12);
+	wb->nr_caches_inseg = nr_blocks_inseg - wb->nr_header_blocks;
+
+	wb->nr_segments = calc_nr_segments(wb);
 	wb->nr_caches = wb->nr_segments * wb->nr_caches_inseg;
 
 	err = init_devices(wb);
@@ -1375,6 +1874,7 @@ bad_synchronizer:
 bad_updater:
 	kthread_stop(wb->writeback_modulator);
 bad_modulator:
+	hrtimer_cancel(&wb->barrier_deadline_timer);
 	destroy_workqueue(wb->barrier_wq);
 bad_flush_barrier_work:
 	kthread_stop(wb->flush_daemon);
@@ -1400,6 +1900,7 @@ void free_cache(struct wb_device *wb)
 	kthread_stop(wb->sb_record_updater);
 	kthread_stop(wb->writeback_modulator);
 
+	hrtimer_cancel(&wb->barrier_deadline_timer);
 	destroy_workqueue(wb->barrier_wq);
 
 	kthread_stop(wb->flush_daemon);
@@ -24,12 +24,16 @@
 
 struct segment_header *
 get_segment_header_by_id(struct wb_device *, u64 segment_id);
-struct rambuffer *get_rambuffer_by_id(struct wb_device *wb, u64 id);
+struct rambuffer *get_free_rambuffer(struct wb_device *);
+void put_rambuffer(struct wb_device *, struct rambuffer *);
+bool has_free_rambuffer(struct wb_device *);
+void shrink_rambuf_pool(struct wb_device *);
 sector_t calc_mb_start_sector(struct wb_device *, struct segment_header *,
 			      u32 mb_idx);
-u8 mb_idx_inseg(struct wb_device *, u32 mb_idx);
+u32 mb_idx_inseg(struct wb_device *, u32 mb_idx);
 struct segment_header *mb_to_seg(struct wb_device *, struct metablock *);
-bool is_on_buffer(struct wb_device *, u32 mb_idx);
+bool is_on_buffer(struct wb_device *, struct segment_header *);
+void sort_segment_mbs(struct segment_header *);
 
 /*----------------------------------------------------------------------------*/
 
@@ -39,18 +43,22 @@ struct lookup_key {
 
 struct ht_head;
 struct ht_head *ht_get_head(struct wb_device *, struct lookup_key *);
+struct mutex *ht_get_lock(struct wb_device *, struct ht_head *);
 struct metablock *ht_lookup(struct wb_device *,
 			    struct ht_head *, struct lookup_key *);
 void ht_register(struct wb_device *, struct ht_head *,
 		 struct metablock *, struct lookup_key *);
 void ht_del(struct wb_device *, struct metablock *);
+bool ht_hashed(struct metablock *);
 void discard_caches_inseg(struct wb_device *, struct segment_header *);
 
 /*----------------------------------------------------------------------------*/
 
 void prepare_segment_header_device(void *rambuffer, struct wb_device *,
 				   struct segment_header *src);
-u32 calc_checksum(void *rambuffer, u8 length);
+u32 calc_checksum(struct wb_device *, void *rambuffer, u32 length);
+void prepare_segment_chunk_device(void *rambuffer, struct wb_device *,
+				  struct segment_header *src, u32 from, u32 to);
 
 /*----------------------------------------------------------------------------*/
 
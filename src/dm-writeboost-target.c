@@ -108,6 +108,21 @@ sector_t dm_devsize(struct dm_dev *dev)
 	return i_size_read(dev->bdev->bd_inode) >> 9;
 }
 
+/*
+ * Flush the caches of all the cache devices. Returns the first error.
+ */
+int flush_cache_devices(struct wb_device *wb)
+{
+	int err = 0;
+	u32 i;
+	for (i = 0; i < wb->nr_cache_devs; i++) {
+		int r = blkdev_issue_flush(wb->cache_devs[i]->bdev, GFP_NOIO, NULL);
+		if (r && !err)
+			err = r;
+	}
+	return err;
+}
+
 /*----------------------------------------------------------------------------*/
 
 void bio_endio_compat(struct bio *bio, int error)
@@ -122,8 +137,10 @@ void bio_endio_compat(struct bio *bio, int error)
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
 #define bi_sector(bio) (bio)->bi_iter.bi_sector
+#define bi_size(bio) (bio)->bi_iter.bi_size
 #else
 #define bi_sector(bio) (bio)->bi_sector
+#define bi_size(bio) (bio)->bi_size
 #endif
 
 static void bio_remap(struct bio *bio, struct dm_dev *dev, sector_t sector)
@@ -178,9 +195,9 @@ static void wake_up_active_wq(wait_queue_head_t *wq)
 
 /*----------------------------------------------------------------------------*/
 
-static u8 count_dirty_caches_remained(struct segment_header *seg)
+static u32 count_dirty_caches_remained(struct segment_header *seg)
 {
-	u8 i, count = 0;
+	u32 i, count = 0;
 	struct metablock *mb;
 	for (i = 0; i < seg->length; i++) {
 		mb = seg->mb_array + i;
@@ -253,143 +270,174 @@ struct dirtiness read_mb_dirtiness(struct wb_device *wb, struct segment_header *
 
 /*----------------------------------------------------------------------------*/
 
-void cursor_init(struct wb_device *wb)
+/*
+ * Pick the log head to write on. Writes on the same CPU go to the same log head.
+ */
+static struct log_head *get_log_head(struct wb_device *wb)
 {
-	wb->cursor = wb->current_seg->start_idx;
-	wb->current_seg->length = 0;
+	return wb->log_heads + (raw_smp_processor_id() % wb->nr_log_heads);
 }
 
 /*
  * Advance the cursor and return the old cursor.
  * After returned, nr_inflight_ios is incremented to wait for this write to complete.
  */
-static u32 advance_cursor(struct wb_device *wb)
-{
-	u32 old;
-	if (wb->cursor == wb->nr_caches)
-		wb->cursor = 0;
-	old = wb->cursor;
-	wb->cursor++;
-	wb->current_seg->length++;
-	BUG_ON(wb->current_seg->length > wb->nr_caches_inseg);
-	atomic_inc(&wb->current_seg->nr_inflight_ios);
+static u32 advance_cursor(struct wb_device *wb, struct log_head *head)
+{
+	u32 old = head->cursor;
+	head->cursor++;
+	head->current_seg->length++;
+	BUG_ON(head->current_seg->length > wb->nr_caches_inseg);
+	atomic_inc(&head->current_seg->nr_inflight_ios);
+
+	/* Let the flush daemon start watching the segment get idle */
+	head->last_write = jiffies;
+	if (head->current_seg->length == 1 && ACCESS_ONCE(wb->idle_flush_ms))
+		wake_up_process(wb->flush_daemon);
+
 	return old;
 }
 
-static bool needs_queue_seg(struct wb_device *wb)
+static bool needs_queue_seg(struct wb_device *wb, struct log_head *head)
 {
-	bool rambuf_no_space = !mb_idx_inseg(wb, wb->cursor);
+	bool rambuf_no_space = head->current_seg->length == wb->nr_caches_inseg;
 	return rambuf_no_space;
 }
 
 /*----------------------------------------------------------------------------*/
 
-static void copy_barrier_requests(struct rambuffer *rambuf, struct wb_device *wb)
-{
-	bio_list_init(&rambuf->barrier_ios);
-	bio_list_merge(&rambuf->barrier_ios, &wb->barrier_ios);
-	bio_list_init(&wb->barrier_ios);
-}
-
-static void prepare_rambuffer(struct rambuffer *rambuf,
-			      struct wb_device *wb,
-			      struct segment_header *seg)
-{
-	rambuf->seg = seg;
-	prepare_segment_header_device(rambuf->data, wb, seg);
-	copy_barrier_requests(rambuf, wb);
-}
-
-static void init_rambuffer(struct wb_device *wb)
+static void init_rambuffer(struct wb_device *wb, struct rambuffer *rambuf)
 {
-	memset(wb->current_rambuf->data, 0, 1 << 12);
+	memset(rambuf->data, 0, wb->nr_header_blocks << 12);
 }
 
 /*
  * Acquire a new RAM buffer for the new segment.
+ * Wait for the flush daemon to return one if the pool can't grow.
  */
-static void __acquire_new_rambuffer(struct wb_device *wb, u64 id)
+static struct rambuffer *__acquire_new_rambuffer(struct wb_device *wb)
 {
-	wait_for_flushing(wb, SUB_ID(id, NR_RAMBUF_POOL));
+	struct rambuffer *rambuf;
 
-	wb->current_rambuf = get_rambuffer_by_id(wb, id);
+	while (!(rambuf = get_free_rambuffer(wb)))
+		wait_event(wb->rambuf_wait_queue, has_free_rambuffer(wb));
 
-	init_rambuffer(wb);
+	init_rambuffer(wb, rambuf);
+	return rambuf;
 }
 
-static void __acquire_new_seg(struct wb_device *wb, u64 id)
+static struct segment_header *__acquire_new_seg(struct wb_device *wb, u64 id)
 {
 	struct segment_header *new_seg = get_segment_header_by_id(wb, id);
 
-	/*
-	 * We wait for all requests to the new segment is consumed.
-	 * Mutex taken guarantees that no new I/O to this segment is coming in.
-	 */
-	wait_event(wb->inflight_ios_wq,
-		!atomic_read(&new_seg->nr_inflight_ios));
-
 	wait_for_writeback(wb, SUB_ID(id, wb->nr_segments));
 	if (count_dirty_caches_remained(new_seg)) {
 		DMERR("%u dirty caches remained. id:%llu",
 		      count_dirty_caches_remained(new_seg), id);
 		BUG();
 	}
+
+	/*
+	 * Unlink the metablocks first so that no new I/O can find this segment
+	 * and then wait for all requests to the new segment is consumed.
+	 */
 	discard_caches_inseg(wb, new_seg);
+	smp_mb(); /* Pairs with cache_lookup_rcu() */
+	wait_event(wb->inflight_ios_wq,
+		!atomic_read(&new_seg->nr_inflight_ios));
 
 	/*
 	 * We mustn't set new id to the new segment before
 	 * all wait_* events are done since they uses those id for waiting.
 	 */
 	new_seg->id = id;
-	wb->current_seg = new_seg;
+	return new_seg;
 }
 
 /*
- * Acquire the new segment and RAM buffer for the following writes.
- * Guarantees all dirty caches in the segments are written back and
- * all metablocks in it are invalidated (Linked to null head).
+ * Acquire the new segment and RAM buffer for the following writes on the
+ * log head. Guarantees all dirty caches in the segments are written back and
+ * all metablocks in it are invalidated (Unlinked from the hash table).
  */
-void acquire_new_seg(struct wb_device *wb, u64 id)
+static void prepare_new_seg(struct wb_device *wb, struct log_head *head)
 {
-	__acquire_new_rambuffer(wb, id);
-	__acquire_new_seg(wb, id);
-}
+	/*
+	 * The RAM buffer is acquired before the id is allocated. Otherwise the
+	 * segments with the later ids could take all the RAM buffers and the
+	 * flush daemon would wait for this segment forever.
+	 */
+	struct rambuffer *rambuf = __acquire_new_rambuffer(wb);
+	u64 next_id = atomic64_inc_return(&wb->last_allocated_segment_id);
+	struct segment_header *seg = __acquire_new_seg(wb, next_id);
 
-static void prepare_new_seg(struct wb_device *wb)
-{
-	u64 next_id = wb->current_seg->id + 1;
-	acquire_new_seg(wb, next_id);
-	cursor_init(wb);
+	seg->length = 0;
+	seg->on_buffer = true;
+	seg->rambuf = rambuf;
+	seg->nr_frozen = 0;
+	seg->commit_length = 0;
+	seg->nr_committed = 0;
+	seg->nr_commits = 0;
+
+	head->cursor = seg->start_idx;
+	head->current_rambuf = rambuf;
+	head->current_seg = seg;
 }
 
 /*----------------------------------------------------------------------------*/
 
-static void queue_flush_job(struct wb_device *wb)
+static void update_last_queued_segment_id(struct wb_device *wb, u64 id)
+{
+	u64 old = atomic64_read(&wb->last_queued_segment_id);
+	while (old < id) {
+		u64 cur = atomic64_cmpxchg(&wb->last_queued_segment_id, old, id);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+/*
+ * Seal the open segment of the log head and queue it to the flush daemon.
+ * The log head opens a new segment on the next write.
+ */
+void queue_current_buffer(struct wb_device *wb, struct log_head *head)
 {
-	wait_event(wb->inflight_ios_wq, !atomic_read(&wb->current_seg->nr_inflight_ios));
+	struct segment_header *seg = head->current_seg;
+	struct rambuffer *rambuf = head->current_rambuf;
+
+	/*
+	 * Stop the in-place writes from the other log heads and wait for the
+	 * ones in flight. Pairs with is_on_buffer().
+	 */
+	seg->on_buffer = false;
+	smp_mb();
+	wait_event(wb->inflight_ios_wq, !atomic_read(&seg->nr_inflight_ios));
 
-	prepare_rambuffer(wb->current_rambuf, wb, wb->current_seg);
+	/*
+	 * The header of the segment is prepared by the flush daemon. The
+	 * checksum over the whole segment is computed out of the log head lock.
+	 */
+	head->current_seg = NULL;
+	head->current_rambuf = NULL;
 
 	smp_wmb();
-	atomic64_inc(&wb->last_queued_segment_id);
+	rambuf->seg = seg;
+	update_last_queued_segment_id(wb, seg->id);
 	wake_up_process(wb->flush_daemon);
 }
 
-static void queue_current_buffer(struct wb_device *wb)
-{
-	queue_flush_job(wb);
-	prepare_new_seg(wb);
-}
-
 /*
- * queue_current_buffer if the RAM buffer can't make space any more.
+ * queue_current_buffer if the RAM buffer can't make space any more and
+ * open a new segment if the log head has none.
  */
-static void might_queue_current_buffer(struct wb_device *wb)
+static void might_queue_current_buffer(struct wb_device *wb, struct log_head *head)
 {
-	if (needs_queue_seg(wb)) {
+	if (head->current_seg && needs_queue_seg(wb, head)) {
 		update_nr_empty_segs(wb);
-		queue_current_buffer(wb);
+		queue_current_buffer(wb, head);
 	}
+	if (!head->current_seg)
+		prepare_new_seg(wb, head);
 }
 
 /*
@@ -397,15 +445,109 @@ static void might_queue_current_buffer(struct wb_device *wb)
  */
 void flush_current_buffer(struct wb_device *wb)
 {
-	struct segment_header *old_seg;
+	u64 id = atomic64_read(&wb->last_allocated_segment_id);
+	u32 i;
+
+	/*
+	 * The segments up to the id are either open or already queued. A log
+	 * head allocates and opens a segment in one lock section.
+	 */
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct log_head *head = wb->log_heads + i;
+		mutex_lock(&head->lock);
+		if (head->current_seg && head->current_seg->id <= id)
+			queue_current_buffer(wb, head);
+		mutex_unlock(&head->lock);
+	}
+
+	wait_for_flushing(wb, id);
+}
+
+/*
+ * Commit the metablocks written so far on the open segment of the log head
+ * without sealing it. The later writes are appended to the segment and
+ * committed as another chunk. Returns the length to be committed.
+ */
+static u32 commit_current_buffer(struct wb_device *wb, struct log_head *head)
+{
+	struct segment_header *seg = head->current_seg;
+	u32 length = seg->length;
+
+	if (length == seg->nr_frozen)
+		return length;
+
+	/*
+	 * Stop the in-place writes on the metablocks to be committed and wait
+	 * for the ones in flight. Pairs with is_frozen_mb().
+	 */
+	seg->nr_frozen = length;
+	smp_mb();
+	wait_event(wb->inflight_ios_wq, !atomic_read(&seg->nr_inflight_ios));
+
+	seg->nr_commits++;
+	smp_wmb();
+	seg->commit_length = length;
+	wake_up_process(wb->flush_daemon);
+	return length;
+}
+
+static bool can_commit_seg(struct wb_device *wb, struct segment_header *seg)
+{
+	/* The last chunk is appended when the segment is sealed */
+	return seg->length < wb->nr_caches_inseg &&
+	       seg->nr_commits < NR_MAX_SEG_CHUNKS - 1;
+}
+
+/*
+ * Same as flush_current_buffer() but the newest segment is committed and kept
+ * open if it can. Forced partial flushes (e.g. barriers) thus don't waste the
+ * rest of the segment. The older segments are sealed because the flush daemon
+ * can't go beyond an open segment.
+ */
+void sync_current_buffer(struct wb_device *wb)
+{
+	u64 id = atomic64_read(&wb->last_allocated_segment_id);
+	struct segment_header *seg = NULL;
+	u32 length = 0;
+	u32 i;
+
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct log_head *head = wb->log_heads + i;
+		mutex_lock(&head->lock);
+		if (head->current_seg && head->current_seg->id <= id) {
+			if (head->current_seg->id == id && can_commit_seg(wb, head->current_seg)) {
+				seg = head->current_seg;
+				length = commit_current_buffer(wb, head);
+			} else
+				queue_current_buffer(wb, head);
+		}
+		mutex_unlock(&head->lock);
+	}
 
-	mutex_lock(&wb->io_lock);
-	old_seg = wb->current_seg;
+	if (seg) {
+		wait_for_flushing(wb, id - 1);
+		wait_for_committing(wb, seg, id, length);
+	} else
+		wait_for_flushing(wb, id);
+}
 
-	queue_current_buffer(wb);
-	mutex_unlock(&wb->io_lock);
+/*
+ * The metablocks (being) committed on the open segment can't be overwritten in
+ * place. Must be called after is_on_buffer().
+ */
+static bool is_frozen_mb(struct wb_device *wb, struct segment_header *seg, struct metablock *mb)
+{
+	return mb_idx_inseg(wb, mb->idx) < ACCESS_ONCE(seg->nr_frozen);
+}
 
-	wait_for_flushing(wb, old_seg->id);
+/*
+ * Is the data of the metablock on the caching device?
+ */
+static bool is_committed_mb(struct wb_device *wb, struct segment_header *seg,
+			    struct metablock *mb, u64 id)
+{
+	return atomic64_read(&wb->last_flushed_segment_id) >= id ||
+	       mb_idx_inseg(wb, mb->idx) < ACCESS_ONCE(seg->nr_committed);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -437,6 +579,8 @@ static void clear_stat(struct wb_device *wb)
 		atomic64_set(v, 0);
 	}
 	atomic64_set(&wb->count_non_full_flushed, 0);
+	atomic64_set(&wb->count_barrier_commits, 0);
+	atomic64_set(&wb->count_barrier_ios, 0);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -476,6 +620,33 @@ static void copy_bio_payload(void *buf, struct bio *bio)
 	ASSERT(sum == (bio_sectors(bio) << 9));
 }
 
+/*
+ * Copy @len bytes of the bio payload from the @skip bytes offset.
+ */
+static void copy_bio_range(void *buf, struct bio *bio, size_t skip, size_t len)
+{
+	bv_vec vec;
+	bv_it it;
+	bio_for_each_segment(vec, bio, it) {
+		void *dst;
+		size_t l = bv_len(vec);
+		if (skip >= l) {
+			skip -= l;
+			continue;
+		}
+		l = min(l - skip, len);
+		dst = kmap_atomic(bv_page(vec));
+		memcpy(buf, dst + bv_offset(vec) + skip, l);
+		kunmap_atomic(dst);
+		buf += l;
+		len -= l;
+		skip = 0;
+		if (!len)
+			break;
+	}
+	ASSERT(!len);
+}
+
 /*
  * Copy 512B buffer data to bio payload's i-th 512B area.
  */
@@ -521,6 +692,7 @@ static void copy_to_bio_payload(struct bio *bio, void *buf, u8 copy_bits)
 struct lookup_result {
 	struct ht_head *head; /* Lookup head used */
 	struct lookup_key key; /* Lookup key used */
+	struct mutex *lock; /* Lock of the lookup head */
 
 	struct segment_header *found_seg;
 	struct metablock *found_mb;
@@ -529,17 +701,21 @@ struct lookup_result {
 	bool on_buffer; /* Is the metablock found on the RAM buffer? */
 };
 
-/*
- * Lookup a bio relevant cache data.
- * In case of cache hit, nr_inflight_ios is incremented.
- */
-static void cache_lookup(struct wb_device *wb, struct bio *bio, struct lookup_result *res)
+static void prepare_lookup(struct wb_device *wb, sector_t sector, struct lookup_result *res)
 {
 	res->key = (struct lookup_key) {
-		.sector = calc_cache_alignment(bi_sector(bio)),
+		.sector = calc_cache_alignment(sector),
 	};
 	res->head = ht_get_head(wb, &res->key);
+	res->lock = ht_get_lock(wb, res->head);
+}
 
+/*
+ * Lookup the cache data of res->key with the lock of the lookup head held.
+ * In case of cache hit, nr_inflight_ios is incremented.
+ */
+static void do_cache_lookup(struct wb_device *wb, struct lookup_result *res)
+{
 	res->found_mb = ht_lookup(wb, res->head, &res->key);
 	if (res->found_mb) {
 		res->found_seg = mb_to_seg(wb, res->found_mb);
@@ -550,9 +726,18 @@ static void cache_lookup(struct wb_device *wb, struct bio *bio, struct lookup_re
 
 	res->on_buffer = false;
 	if (res->found)
-		res->on_buffer = is_on_buffer(wb, res->found_mb->idx);
+		res->on_buffer = is_on_buffer(wb, res->found_seg);
+}
 
-	inc_stat(wb, bio_is_write(bio), res->found, res->on_buffer, bio_is_fullsize(bio));
+/*
+ * Lookup the cache data of the block the bio starts with.
+ * The lock of the lookup head is taken and the caller must release it.
+ */
+static void cache_lookup(struct wb_device *wb, struct bio *bio, struct lookup_result *res)
+{
+	prepare_lookup(wb, bi_sector(bio), res);
+	mutex_lock(res->lock);
+	do_cache_lookup(wb, res);
 }
 
 static void dec_inflight_ios(struct wb_device *wb, struct segment_header *seg)
@@ -561,6 +746,51 @@ static void dec_inflight_ios(struct wb_device *wb, struct segment_header *seg)
 		wake_up_active_wq(&wb->inflight_ios_wq);
 }
 
+/*
+ * Lookup the cache data of the block the bio starts with without the lock of
+ * the lookup head. Returns true iff the cache is found. The segment is pinned
+ * (nr_inflight_ios incremented) as do_cache_lookup() does.
+ *
+ * A miss must be confirmed with the lock held because reserving a read cache
+ * cell has to be serialized with the writes to the block.
+ */
+static bool cache_lookup_rcu(struct wb_device *wb, struct bio *bio, struct lookup_result *res)
+{
+	struct metablock *mb;
+	struct segment_header *seg;
+
+	prepare_lookup(wb, bi_sector(bio), res);
+
+	rcu_read_lock();
+	mb = ht_lookup(wb, res->head, &res->key);
+	if (!mb) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	seg = mb_to_seg(wb, mb);
+	atomic_inc(&seg->nr_inflight_ios);
+
+	/*
+	 * The metablock may have been removed and its segment reused before
+	 * we pinned the segment. The segment is no longer reused so we check
+	 * the metablock again. Pairs with the barrier in __acquire_new_seg().
+	 */
+	smp_mb();
+	if (!ht_hashed(mb) || mb->sector != res->key.sector) {
+		rcu_read_unlock();
+		dec_inflight_ios(wb, seg);
+		return false;
+	}
+	rcu_read_unlock();
+
+	res->found_mb = mb;
+	res->found_seg = seg;
+	res->found = true;
+	res->on_buffer = is_on_buffer(wb, seg);
+	return true;
+}
+
 /*----------------------------------------------------------------------------*/
 
 static u8 to_mask(u8 offset, u8 count)
@@ -617,17 +847,19 @@ bad:
  * Get the reference to the 4KB-aligned data in RAM buffer.
  * Since it only takes the reference caller need not to free the pointer.
  */
-static void *ref_buffered_mb(struct wb_device *wb, struct metablock *mb)
+static void *ref_buffered_mb(struct wb_device *wb, struct segment_header *seg,
+			     struct metablock *mb)
 {
-	sector_t offset = ((mb_idx_inseg(wb, mb->idx) + 1) << 3);
-	return wb->current_rambuf->data + (offset << 9);
+	sector_t offset = ((wb->nr_header_blocks + mb_idx_inseg(wb, mb->idx)) << 3);
+	return seg->rambuf->data + (offset << 9);
 }
 
 /*
- * Read cache block of the mb.
+ * Read cache block of the mb synchronously. The writes never call this with
+ * the locks held (cf. read_old_data_async).
  * Caller should free the returned pointer after used by mempool_alloc().
  */
-static void *read_mb(struct wb_device *wb, struct segment_header *seg,
+void *read_mb(struct wb_device *wb, struct segment_header *seg,
 		     struct metablock *mb, u8 data_bits)
 {
 	u8 i;
@@ -652,7 +884,7 @@ static void *read_mb(struct wb_device *wb, struct segment_header *seg,
 		};
 
 		region = (struct dm_io_region) {
-			.bdev = wb->cache_dev->bdev,
+			.bdev = seg->cache_dev->bdev,
 			.sector = calc_mb_start_sector(wb, seg, mb->idx) + i,
 			.count = 1,
 		};
@@ -672,6 +904,25 @@ enum PBD_FLAG {
 	PBD_NONE = 0,
 	PBD_WILL_CACHE = 1,
 	PBD_READ_SEG = 2,
+	PBD_PARTIAL_MERGE = 3,
+};
+
+/*
+ * A write that partially overwrites a dirty cache block on the caching device
+ * needs the old data to merge. The bio is parked while the old data is read
+ * asynchronously and the write resumes from the block when it arrives.
+ */
+struct partial_merge {
+	struct wb_device *wb;
+	struct bio *bio;
+	sector_t sector; /* The block to resume from */
+	struct segment_header *seg; /* Not pinned */
+	u64 id; /* The id of seg when parked */
+	struct metablock *mb;
+	u8 data_bits;
+	void *buf; /* The old data */
+	int err;
+	struct work_struct work;
 };
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
@@ -681,9 +932,11 @@ enum PBD_FLAG {
 #endif
 struct per_bio_data {
 	enum PBD_FLAG type;
+	u64 seg_id; /* The newest segment the write is on. For FUA */
 	union {
 		u32 cell_idx;
 		struct segment_header *seg;
+		struct partial_merge merge;
 	};
 };
 #define per_bio_data(wb, bio) ((struct per_bio_data *)dm_per_bio_data((bio), (wb)->ti->PER_BIO_DATA_SIZE))
@@ -789,13 +1042,17 @@ static bool reserve_read_cache_cell(struct wb_device *wb, struct bio *bio)
 	if (!bio_is_fullsize(bio))
 		return false;
 
+	spin_lock(&cells->lock);
+
 	/*
 	 * We don't need to reserve the same address twice
 	 * because it's either unchanged or invalidated.
 	 */
 	found = lookup_read_cache_cell(wb, bi_sector(bio));
-	if (found)
+	if (found || !cells->cursor) {
+		spin_unlock(&cells->lock);
 		return false;
+	}
 
 	cells->cursor--;
 	new_cell = cells->array + cells->cursor;
@@ -809,15 +1066,23 @@ static bool reserve_read_cache_cell(struct wb_device *wb, struct bio *bio)
 	/* Cancel the new_cell if needed */
 	read_cache_cancel_foreground(cells, new_cell);
 
+	spin_unlock(&cells->lock);
+
 	return true;
 }
 
-static void might_cancel_read_cache_cell(struct wb_device *wb, struct bio *bio)
+/*
+ * Cancel the read cache cell of the address since the data is now stale.
+ * The caller holds the lock of the lookup head of the address.
+ */
+static void might_cancel_read_cache_cell(struct wb_device *wb, sector_t sector)
 {
 	struct read_cache_cell *found;
-	found = lookup_read_cache_cell(wb, calc_cache_alignment(bi_sector(bio)));
+	spin_lock(&wb->read_cache_cells->lock);
+	found = lookup_read_cache_cell(wb, calc_cache_alignment(sector));
 	if (found)
 		found->cancelled = true;
+	spin_unlock(&wb->read_cache_cells->lock);
 }
 
 static void read_cache_cell_copy_data(struct wb_device *wb, struct bio *bio, unsigned long error)
@@ -851,33 +1116,43 @@ static void inject_read_cache(struct wb_device *wb, struct read_cache_cell *cell
 	struct metablock *mb;
 	u32 _mb_idx_inseg;
 	struct segment_header *seg;
+	struct log_head *log_head = get_log_head(wb);
+	struct mutex *lock;
 
 	struct lookup_key key = {
 		.sector = cell->sector,
 	};
 	struct ht_head *head = ht_get_head(wb, &key);
 
-	mutex_lock(&wb->io_lock);
+	/* Fast path. Cancelled cells are never uncancelled. */
+	if (ACCESS_ONCE(cell->cancelled))
+		return;
+
+	mutex_lock(&log_head->lock);
+	might_queue_current_buffer(wb, log_head);
+
+	lock = ht_get_lock(wb, head);
+	mutex_lock(lock);
 	/*
 	 * if might_cancel_read_cache_cell() on the foreground
 	 * cancelled this cell, the data is now stale.
 	 */
 	if (cell->cancelled) {
-		mutex_unlock(&wb->io_lock);
+		mutex_unlock(lock);
+		mutex_unlock(&log_head->lock);
 		return;
 	}
 
-	might_queue_current_buffer(wb);
-
-	seg = wb->current_seg;
-	_mb_idx_inseg = mb_idx_inseg(wb, advance_cursor(wb));
+	seg = log_head->current_seg;
+	_mb_idx_inseg = mb_idx_inseg(wb, advance_cursor(wb, log_head));
 
 	/*
 	 * We should copy the cell data into the rambuf with lock held
 	 * otherwise subsequent write data may be written first and then overwritten by
 	 * the old data in the cell.
 	 */
-	memcpy(wb->current_rambuf->data + ((_mb_idx_inseg + 1) << 12), cell->data, 1 << 12);
+	memcpy(log_head->current_rambuf->data + ((wb->nr_header_blocks + _mb_idx_inseg) << 12),
+	       cell->data, 1 << 12);
 
 	mb = seg->mb_array + _mb_idx_inseg;
 	ASSERT(!mb->dirtiness.is_dirty);
@@ -885,7 +1160,8 @@ static void inject_read_cache(struct wb_device *wb, struct read_cache_cell *cell
 
 	ht_register(wb, head, mb, &key);
 
-	mutex_unlock(&wb->io_lock);
+	mutex_unlock(lock);
+	mutex_unlock(&log_head->lock);
 
 	dec_inflight_ios(wb, seg);
 }
@@ -912,6 +1188,7 @@ static struct read_cache_cells *alloc_read_cache_cells(struct wb_device *wb, u32
 	cells->last_sector = ~0;
 	cells->seqcount = 0;
 	cells->over_threshold = false;
+	spin_lock_init(&cells->lock);
 	cells->array = kmalloc(sizeof(struct read_cache_cell) * n, GFP_KERNEL);
 	if (!cells->array)
 		goto bad_cells_array;
@@ -958,7 +1235,7 @@ static void reinit_read_cache_cells(struct wb_device *wb)
 	struct read_cache_cells *cells = wb->read_cache_cells;
 	u32 i, cur_threshold;
 
-	mutex_lock(&wb->io_lock);
+	spin_lock(&cells->lock);
 	cells->rb_root = RB_ROOT;
 	cells->cursor = cells->size;
 	atomic_set(&cells->ack_count, cells->size);
@@ -971,7 +1248,7 @@ static void reinit_read_cache_cells(struct wb_device *wb)
 		cells->threshold = cur_threshold;
 		cells->over_threshold = false;
 	}
-	mutex_unlock(&wb->io_lock);
+	spin_unlock(&cells->lock);
 }
 
 /*
@@ -1044,14 +1321,6 @@ static int init_read_cache_cells(struct wb_device *wb)
 
 /*----------------------------------------------------------------------------*/
 
-static void initialize_write_io(struct write_io *wio, struct bio *bio)
-{
-	u8 offset = bio_calc_offset(bio);
-	sector_t count = bio_sectors(bio);
-	copy_bio_payload(wio->data + (offset << 9), bio);
-	wio->data_bits = to_mask(offset, count);
-}
-
 static void memcpy_masked(void *to, u8 protect_bits, void *from, u8 copy_bits)
 {
 	u8 i;
@@ -1065,122 +1334,409 @@ static void memcpy_masked(void *to, u8 protect_bits, void *from, u8 copy_bits)
 	}
 }
 
-int prepare_overwrite(struct wb_device *wb, struct segment_header *seg, struct metablock *old_mb, struct write_io* wio, u8 overwrite_bits)
+static bool needs_merge_prev_cache(struct dirtiness dirtiness, u8 overwrite_bits)
 {
-	struct dirtiness dirtiness = read_mb_dirtiness(wb, seg, old_mb);
-
-	bool needs_merge_prev_cache = !(overwrite_bits == 255) || !(dirtiness.data_bits == 255);
+	bool ret = !(overwrite_bits == 255) || !(dirtiness.data_bits == 255);
 
 	if (!dirtiness.is_dirty)
-		needs_merge_prev_cache = false;
+		ret = false;
 
 	if (overwrite_bits == 255)
-		needs_merge_prev_cache = false;
+		ret = false;
 
-	if (unlikely(needs_merge_prev_cache)) {
-		void *buf;
-
-		wait_for_flushing(wb, seg->id);
-		ASSERT(dirtiness.is_dirty);
-
-		buf = read_mb(wb, seg, old_mb, dirtiness.data_bits);
-		if (!buf)
-			return -EIO;
+	return ret;
+}
 
-		/* newer data should be prioritized */
-		memcpy_masked(wio->data, wio->data_bits, buf, dirtiness.data_bits);
-		wio->data_bits |= dirtiness.data_bits;
-		mempool_free(buf, wb->buf_8_pool);
-	}
+/*
+ * Drop the old cache overwritten. The caller must have merged the old data if
+ * needed: the write reads it asynchronously (cf. read_old_data_async) and the
+ * replay writes it back first.
+ */
+void prepare_overwrite(struct wb_device *wb, struct metablock *old_mb)
+{
+	ht_del(wb, old_mb);
 
 	if (mark_clean_mb(wb, old_mb))
 		dec_nr_dirty_caches(wb);
-
-	ht_del(wb, old_mb);
-
-	return 0;
 }
 
 /*
  * Get a new place to write.
  */
-static struct metablock *prepare_new_write_pos(struct wb_device *wb)
+static struct metablock *prepare_new_write_pos(struct wb_device *wb, struct log_head *head)
 {
-	struct metablock *ret = wb->current_seg->mb_array + mb_idx_inseg(wb, advance_cursor(wb));
+	struct metablock *ret = head->current_seg->mb_array + mb_idx_inseg(wb, advance_cursor(wb, head));
 	ASSERT(!ret->dirtiness.is_dirty);
 	ret->dirtiness.data_bits = 0;
 	return ret;
 }
 
-static void write_on_rambuffer(struct wb_device *wb, struct metablock *write_pos, struct write_io *wio)
+/*
+ * Write the data to the slot of @write_pos in the RAM buffer.
+ * The data is copied from the bio payload directly unless it's staged in
+ * wio->data to merge the old data.
+ */
+static void write_on_rambuffer(struct wb_device *wb, struct segment_header *seg,
+			       struct metablock *write_pos, struct write_io *wio)
 {
-	size_t mb_offset = (mb_idx_inseg(wb, write_pos->idx) + 1) << 12;
-	void *mb_data = wb->current_rambuf->data + mb_offset;
+	void *mb_data = ref_buffered_mb(wb, seg, write_pos);
 	if (wio->data_bits == 255)
 		memcpy(mb_data, wio->data, 1 << 12);
 	else
 		memcpy_masked(mb_data, 0, wio->data, wio->data_bits);
 }
 
-static int do_process_write(struct wb_device *wb, struct bio *bio)
+/*
+ * Unlock the lookup head (if any) to wait for something. Acquiring a new
+ * segment also takes the locks of the lookup heads.
+ */
+static void unlock_lookup_head(struct mutex **lock)
 {
-	int err = 0;
+	if (*lock) {
+		mutex_unlock(*lock);
+		*lock = NULL;
+	}
+}
 
-	struct metablock *write_pos = NULL;
-	struct lookup_result res;
+/*
+ * Write the bio on the log head. The lock of the log head must be held. It's
+ * held on return as well but can be released in between to wait for flushing.
+ *
+ * The blocks (4KB aligned part) of the bio are written one by one and the lock
+ * of the lookup head is held over the blocks as long as they share it.
+ *
+ * Returns -EINPROGRESS if the bio is parked to read the old data to merge.
+ * The caller should call read_old_data_async() after unlocking the log head.
+ */
+static int __do_process_write(struct wb_device *wb, struct log_head *log_head, struct bio *bio)
+{
+	struct mutex *lock = NULL; /* The lock of the lookup head held */
+	struct per_bio_data *pbd = per_bio_data(wb, bio);
+	struct partial_merge *pm = &pbd->merge;
+	bool resumed = pbd->type == PBD_PARTIAL_MERGE; /* pm->buf has the old data */
+	sector_t sector = resumed ? pm->sector : bi_sector(bio);
+	sector_t end = bi_sector(bio) + bio_sectors(bio);
+
+	if (!resumed)
+		pbd->seg_id = 0;
+
+retry:
+	while (sector < end) {
+		struct lookup_result res;
+		struct metablock *write_pos;
+		struct segment_header *write_seg;
+		u8 offset = calc_offset(sector);
+		u8 len = min_t(sector_t, (1 << 3) - offset, end - sector);
+		size_t skip = (sector - bi_sector(bio)) << 9;
+		struct write_io wio = {
+			.data = NULL, /* Staged only to merge the old data */
+			.data_bits = to_mask(offset, len),
+		};
 
-	struct write_io wio;
-	wio.data = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
-	if (!wio.data)
-		return -ENOMEM;
-	initialize_write_io(&wio, bio);
+		if (!log_head->current_seg || needs_queue_seg(wb, log_head)) {
+			unlock_lookup_head(&lock);
+			might_queue_current_buffer(wb, log_head);
+		}
+
+		prepare_lookup(wb, sector, &res);
+		if (res.lock != lock) {
+			unlock_lookup_head(&lock);
+			lock = res.lock;
+			mutex_lock(lock);
+		}
+		do_cache_lookup(wb, &res);
+		inc_stat(wb, 1, res.found, res.on_buffer, len == (1 << 3));
+
+		if (res.found) {
+			u64 found_id = res.found_seg->id;
+			struct dirtiness dirtiness;
+			bool needs_merge;
+
+			if (unlikely(res.on_buffer) &&
+			    !is_frozen_mb(wb, res.found_seg, res.found_mb)) {
+				write_pos = res.found_mb;
+				goto do_write;
+			}
 
-	mutex_lock(&wb->io_lock);
+			/*
+			 * The log is replayed in the order of the id so the new
+			 * data must go to a newer segment than the old one. The
+			 * old one can be newer if the other log head sealed it
+			 * after this log head opened the current segment.
+			 */
+			if (unlikely(found_id > log_head->current_seg->id)) {
+				dec_inflight_ios(wb, res.found_seg);
+				unlock_lookup_head(&lock);
+				atomic64_inc(&wb->count_non_full_flushed);
+				queue_current_buffer(wb, log_head);
+				continue;
+			}
 
-	cache_lookup(wb, bio, &res);
+			/*
+			 * Merging the old data needs the segment flushed (or
+			 * the metablock committed). We shouldn't wait for it
+			 * with the locks held because flushing the segment may
+			 * need to seal this log head.
+			 */
+			dirtiness = read_mb_dirtiness(wb, res.found_seg, res.found_mb);
+			needs_merge = needs_merge_prev_cache(dirtiness, wio.data_bits);
+			if (unlikely(needs_merge) &&
+			    !is_committed_mb(wb, res.found_seg, res.found_mb, found_id)) {
+				u32 length = mb_idx_inseg(wb, res.found_mb->idx) + 1;
+				struct segment_header *found_seg = res.found_seg;
+
+				dec_inflight_ios(wb, res.found_seg);
+				unlock_lookup_head(&lock);
+				mutex_unlock(&log_head->lock);
+
+				wait_for_committing(wb, found_seg, found_id, length);
+				mutex_lock(&log_head->lock);
+				goto retry;
+			}
 
-	if (res.found) {
-		if (unlikely(res.on_buffer)) {
-			write_pos = res.found_mb;
-			goto do_write;
-		} else {
-			err = prepare_overwrite(wb, res.found_seg, res.found_mb, &wio, wio.data_bits);
-			dec_inflight_ios(wb, res.found_seg);
-			if (err)
-				goto out;
-		}
-	} else
-		might_cancel_read_cache_cell(wb, bio);
+			/*
+			 * Park the bio to read the old data without the locks
+			 * unless it's been read. The segment isn't pinned while
+			 * parked so the old data is valid only if the same
+			 * metablock is found in the segment of the same id.
+			 * The segment is reused with a newer id.
+			 */
+			if (unlikely(needs_merge) &&
+			    !(resumed && pm->sector == sector &&
+			      pm->mb == res.found_mb && pm->id == found_id)) {
+				if (!resumed)
+					pm->buf = NULL;
+				pm->wb = wb;
+				pm->bio = bio;
+				pm->sector = sector;
+				pm->seg = res.found_seg;
+				pm->id = found_id;
+				pm->mb = res.found_mb;
+				pm->data_bits = dirtiness.data_bits;
+				pbd->type = PBD_PARTIAL_MERGE;
+
+				dec_inflight_ios(wb, res.found_seg);
+				unlock_lookup_head(&lock);
+				return -EINPROGRESS;
+			}
+
+			/* newer data should be prioritized */
+			if (unlikely(needs_merge)) {
+				wio.data = pm->buf;
+				copy_bio_range(wio.data + (offset << 9), bio, skip, len << 9);
+				wio.data_bits |= dirtiness.data_bits;
+			}
 
-	might_queue_current_buffer(wb);
+			/* The old data is merged already if needed */
+			prepare_overwrite(wb, res.found_mb);
+			dec_inflight_ios(wb, res.found_seg);
+		} else
+			might_cancel_read_cache_cell(wb, sector);
 
-	write_pos = prepare_new_write_pos(wb);
+		write_pos = prepare_new_write_pos(wb, log_head);
 
 do_write:
-	ASSERT(write_pos);
-	write_on_rambuffer(wb, write_pos, &wio);
+		write_seg = mb_to_seg(wb, write_pos);
+		if (wio.data)
+			write_on_rambuffer(wb, write_seg, write_pos, &wio);
+		else
+			copy_bio_range(ref_buffered_mb(wb, write_seg, write_pos) + (offset << 9), bio, skip, len << 9);
+
+		if (taint_mb(wb, write_pos, wio.data_bits))
+			inc_nr_dirty_caches(wb);
 
-	if (taint_mb(wb, write_pos, wio.data_bits))
-		inc_nr_dirty_caches(wb);
+		ht_register(wb, res.head, write_pos, &res.key);
+
+		if (write_seg->id > pbd->seg_id)
+			pbd->seg_id = write_seg->id;
+
+		/* The data is on the RAM buffer. The segment can be sealed now */
+		dec_inflight_ios(wb, write_seg);
+
+		sector += len;
+	}
+
+	unlock_lookup_head(&lock);
+	if (resumed) {
+		mempool_free(pm->buf, wb->buf_8_pool);
+		pbd->type = PBD_NONE;
+	}
+	return 0;
+}
 
-	ht_register(wb, res.head, write_pos, &res.key);
+static void resume_partial_merge(struct work_struct *);
 
-out:
-	mutex_unlock(&wb->io_lock);
-	mempool_free(wio.data, wb->buf_8_pool);
+static void read_old_data_async_callback(unsigned long error, void *context)
+{
+	struct partial_merge *pm = context;
+	pm->err = error ? -EIO : 0;
+	queue_work(pm->wb->deferred_wq, &pm->work);
+}
+
+/*
+ * Read the old data of the parked bio into the staging buffer. The bio is
+ * resumed in the worker when the data arrives.
+ */
+static void read_old_data_async(struct wb_device *wb, struct bio *bio)
+{
+	struct partial_merge *pm = &per_bio_data(wb, bio)->merge;
+	struct dm_io_request io_req;
+	struct dm_io_region region;
+
+	INIT_WORK(&pm->work, resume_partial_merge);
+
+	if (!pm->buf)
+		pm->buf = mempool_alloc(wb->buf_8_pool, GFP_NOIO);
+	if (!pm->buf) {
+		read_old_data_async_callback(1, pm);
+		return;
+	}
+
+	io_req = (struct dm_io_request) {
+		WB_IO_READ,
+		.client = wb->io_client,
+		.notify.fn = read_old_data_async_callback,
+		.notify.context = pm,
+		.mem.type = DM_IO_KMEM,
+		.mem.ptr.addr = pm->buf,
+	};
+	region = (struct dm_io_region) {
+		.bdev = pm->seg->cache_dev->bdev,
+		.sector = calc_mb_start_sector(wb, pm->seg, pm->mb->idx),
+		.count = 8,
+	};
+
+	if (wb_io(&io_req, 1, &region, NULL, false))
+		read_old_data_async_callback(1, pm);
+}
+
+static int do_process_write(struct wb_device *wb, struct bio *bio)
+{
+	int err;
+	struct log_head *log_head = get_log_head(wb);
+
+	mutex_lock(&log_head->lock);
+	err = __do_process_write(wb, log_head, bio);
+	mutex_unlock(&log_head->lock);
 	return err;
 }
 
-static int complete_process_write(struct wb_device *wb, struct bio *bio)
+/*
+ * FUA write is acked when the segments it's on are written with FUA. Unlike
+ * barrier, this doesn't need the cache of the caching device flushed as long
+ * as the preceding segments are written with FUA as well.
+ */
+static void queue_fua_io(struct wb_device *wb, struct bio *bio)
 {
-	dec_inflight_ios(wb, wb->current_seg);
+	unsigned long flags;
+	u64 id = per_bio_data(wb, bio)->seg_id;
+
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	bio_list_add(&wb->fua_ios, bio);
+	if (id > wb->fua_id)
+		wb->fua_id = id;
+	start_barrier_deadline(wb, &wb->flush_fua_work);
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+}
+
+/*
+ * Should the segment be written with FUA?
+ */
+bool needs_fua_seg(struct wb_device *wb, u64 id)
+{
+	bool ret;
+	unsigned long flags;
+
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	ret = id <= wb->fua_id;
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+	return ret;
+}
+
+/*
+ * Ack the FUA writes on the segments flushed so far. Must be called after
+ * last_flushed_segment_id is counted up to @flushed_id.
+ */
+void process_deferred_fua_ios(struct wb_device *wb, u64 flushed_id)
+{
+	struct bio_list fua_ios, rest;
+	struct bio *bio;
+	unsigned long flags;
+	u64 durable_id = atomic64_read(&wb->last_durable_segment_id);
+	bool needs_flush = false;
+	int err = 0;
+	u64 count = 0;
+
+	bio_list_init(&fua_ios);
+	bio_list_init(&rest);
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	while ((bio = bio_list_pop(&wb->fua_ios))) {
+		u64 id = per_bio_data(wb, bio)->seg_id;
+		if (id > flushed_id) {
+			bio_list_add(&rest, bio);
+			continue;
+		}
+		if (id > durable_id)
+			needs_flush = true;
+		bio_list_add(&fua_ios, bio);
+	}
+	bio_list_merge(&wb->fua_ios, &rest);
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+
+	if (bio_list_empty(&fua_ios))
+		return;
 
 	/*
-	 * bio with FUA flag has data.
-	 * We first handle it as a normal write bio and then as a barrier bio.
+	 * The segment was flushed without FUA because the FUA write was queued
+	 * after the flush daemon had started writing it.
 	 */
+	if (needs_flush) {
+		err = flush_cache_devices(wb);
+		if (!err)
+			atomic64_set(&wb->last_durable_segment_id, flushed_id);
+	}
+
+	while ((bio = bio_list_pop(&fua_ios))) {
+		bio_endio_compat(bio, err);
+		count++;
+	}
+	atomic64_inc(&wb->count_barrier_commits);
+	atomic64_add(count, &wb->count_barrier_ios);
+}
+
+/*
+ * Seal the open segments that the FUA writes are on so they are flushed
+ * immediately. Unlike flush_current_buffer() this doesn't wait for flushing.
+ */
+void flush_fua_ios(struct work_struct *work)
+{
+	struct wb_device *wb = container_of(work, struct wb_device, flush_fua_work);
+	unsigned long flags;
+	u64 id;
+	u32 i;
+
+	spin_lock_irqsave(&wb->barrier_lock, flags);
+	id = wb->fua_id;
+	spin_unlock_irqrestore(&wb->barrier_lock, flags);
+
+	for (i = 0; i < wb->nr_log_heads; i++) {
+		struct log_head *head = wb->log_heads + i;
+		mutex_lock(&head->lock);
+		if (head->current_seg && head->current_seg->id <= id) {
+			atomic64_inc(&wb->count_non_full_flushed);
+			queue_current_buffer(wb, head);
+		}
+		mutex_unlock(&head->lock);
+	}
+
+	/* The segments may have been flushed before the FUA writes are queued */
+	process_deferred_fua_ios(wb, atomic64_read(&wb->last_flushed_segment_id));
+}
+
+static int complete_process_write(struct wb_device *wb, struct bio *bio)
+{
 	if (bio_is_fua(bio)) {
-		queue_barrier_io(wb, bio);
+		queue_fua_io(wb, bio);
 		return DM_MAPIO_SUBMITTED;
 	}
 
@@ -1211,43 +1767,295 @@ static int complete_process_write(struct wb_device *wb, struct bio *bio)
  *
  * process_write:
  *   do_process_write:
- *     mutex_lock (to serialize write)
- *       inc in_flight_ios # refcount on the dst segment
+ *     mutex_lock (log head, to serialize writes on the log head)
+ *       mutex_lock (lookup head, to serialize writes on the address)
+ *         inc in_flight_ios # refcount on the dst segment
+ *         copy the data to the RAM buffer
+ *         dec in_flight_ios
+ *       mutex_unlock
  *     mutex_unlock
  *
  *   complete_process_write:
- *     dec in_flight_ios
  *     bio_endio(bio)
+ *
+ * The locks are never held while waiting for a segment to be flushed
+ * because the flush daemon may need to seal the log head. Nor while reading
+ * the old data to merge: the bio is parked and resumed by the worker.
  */
 static int process_write_wb(struct wb_device *wb, struct bio *bio)
 {
 	int err = do_process_write(wb, bio);
+	if (err == -EINPROGRESS) {
+		read_old_data_async(wb, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
 	if (err)
 		return err;
 	return complete_process_write(wb, bio);
 }
 
+static void resume_partial_merge(struct work_struct *work)
+{
+	struct partial_merge *pm = container_of(work, struct partial_merge, work);
+	struct wb_device *wb = pm->wb;
+	struct bio *bio = pm->bio;
+	int err;
+
+	if (pm->err) {
+		if (pm->buf)
+			mempool_free(pm->buf, wb->buf_8_pool);
+		per_bio_data(wb, bio)->type = PBD_NONE;
+		bio_endio_compat(bio, pm->err);
+		return;
+	}
+
+	err = process_write_wb(wb, bio);
+	if (err < 0)
+		bio_endio_compat(bio, err);
+}
+
 static int process_write_wa(struct wb_device *wb, struct bio *bio)
 {
-	struct lookup_result res;
+	struct mutex *lock = NULL;
+	sector_t sector = bi_sector(bio);
+	sector_t end = sector + bio_sectors(bio);
 
-	mutex_lock(&wb->io_lock);
-	cache_lookup(wb, bio, &res);
-	if (res.found) {
-		dec_inflight_ios(wb, res.found_seg);
-		ht_del(wb, res.found_mb);
+	while (sector < end) {
+		struct lookup_result res;
+
+		prepare_lookup(wb, sector, &res);
+		if (res.lock != lock) {
+			unlock_lookup_head(&lock);
+			lock = res.lock;
+			mutex_lock(lock);
+		}
+		do_cache_lookup(wb, &res);
+		inc_stat(wb, 1, res.found, res.on_buffer,
+			 sector == res.key.sector && end - sector >= (1 << 3));
+		if (res.found) {
+			dec_inflight_ios(wb, res.found_seg);
+			ht_del(wb, res.found_mb);
+		}
+
+		might_cancel_read_cache_cell(wb, sector);
+
+		sector = res.key.sector + (1 << 3);
 	}
+	unlock_lookup_head(&lock);
 
-	might_cancel_read_cache_cell(wb, bio);
-	mutex_unlock(&wb->io_lock);
+	bio_remap(bio, wb->backing_dev, bi_sector(bio));
+	return DM_MAPIO_REMAPPED;
+}
+
+/*
+ * Sequential write bypass
+ * -----------------------
+ * A long sequential write stream is written to the backing device directly.
+ * Caching such a stream only evicts the other caches while the backing device
+ * handles sequential writes well.
+ */
+static bool is_sequential_write(struct wb_device *wb, struct bio *bio)
+{
+	bool ret;
+
+	u32 threshold = ACCESS_ONCE(wb->write_seq_threshold);
+	if (!threshold)
+		return false;
+
+	spin_lock(&wb->write_seq_lock);
+	if (bi_sector(bio) == wb->write_seq_next_sector)
+		wb->write_seq_count += bio_sectors(bio);
+	else
+		wb->write_seq_count = bio_sectors(bio);
+	wb->write_seq_next_sector = bi_sector(bio) + bio_sectors(bio);
+	ret = wb->write_seq_count > (threshold << 3);
+	spin_unlock(&wb->write_seq_lock);
+
+	return ret;
+}
+
+/*
+ * Invalidate the caches of the bio before writing it to the backing device.
+ * Returns false if any of the caches isn't yet written back. Such cache can't
+ * be invalidated because it's replayed on the next resume and its stale data
+ * is written back over the new data.
+ *
+ * @max_id (out) : The max id of the segments that had the invalidated caches
+ */
+static bool invalidate_bypassed_caches(struct wb_device *wb, struct bio *bio, u64 *max_id)
+{
+	bool ret = true;
+	struct mutex *lock = NULL;
+	sector_t sector = bi_sector(bio);
+	sector_t end = sector + bio_sectors(bio);
+
+	*max_id = 0;
+	while (sector < end) {
+		struct lookup_result res;
+
+		prepare_lookup(wb, sector, &res);
+		if (res.lock != lock) {
+			unlock_lookup_head(&lock);
+			lock = res.lock;
+			mutex_lock(lock);
+		}
+		do_cache_lookup(wb, &res);
+		if (res.found) {
+			u64 id = res.found_seg->id;
+			bool written_back = !res.on_buffer &&
+				(id <= atomic64_read(&wb->last_writeback_segment_id));
+
+			dec_inflight_ios(wb, res.found_seg);
+			if (!written_back) {
+				ret = false;
+				break;
+			}
+			ht_del(wb, res.found_mb);
+			*max_id = max(*max_id, id);
+		}
+		inc_stat(wb, 1, res.found, false,
+			 sector == res.key.sector && end - sector >= (1 << 3));
+
+		might_cancel_read_cache_cell(wb, sector);
+
+		sector = res.key.sector + (1 << 3);
+	}
+	unlock_lookup_head(&lock);
+
+	return ret;
+}
+
+/*
+ * The caches of the bypassed blocks may remain in the segments that are
+ * already written back and reused (or invalidated above). The replay skips
+ * the segments recorded in the superblock so the record should cover them
+ * before the data is written to the backing device.
+ */
+static int might_update_superblock_record(struct wb_device *wb, u64 max_id)
+{
+	u64 required = min_t(u64,
+		SUB_ID(atomic64_read(&wb->last_allocated_segment_id), wb->nr_segments),
+		atomic64_read(&wb->last_writeback_segment_id));
+	required = max(required, max_id);
+
+	if (atomic64_read(&wb->last_recorded_segment_id) >= required)
+		return 0;
+
+	return update_superblock_record(wb, true);
+}
+
+static int process_write_bypass(struct wb_device *wb, struct bio *bio)
+{
+	u64 max_id;
+
+	/*
+	 * The data that can't be bypassed safely is cached as usual.
+	 * The new cache takes over the caches invalidated so far.
+	 */
+	if (!invalidate_bypassed_caches(wb, bio, &max_id) ||
+	    might_update_superblock_record(wb, max_id))
+		return process_write_wb(wb, bio);
 
 	bio_remap(bio, wb->backing_dev, bi_sector(bio));
 	return DM_MAPIO_REMAPPED;
 }
 
+/*
+ * Pass down the discard of [@start, @end) to the backing device. The discard
+ * isn't passed down unless the caches removed are never replayed. Ignoring the
+ * discard is always safe.
+ */
+static void discard_backing_range(struct wb_device *wb, sector_t start, sector_t end,
+				  u64 max_id)
+{
+	if (start >= end ||
+	    !blk_queue_discard(bdev_get_queue(wb->backing_dev->bdev)) ||
+	    might_update_superblock_record(wb, max_id))
+		return;
+
+	blkdev_issue_discard(wb->backing_dev->bdev, start, end - start, GFP_NOIO, 0);
+}
+
+/*
+ * The discard is passed down only for the 4KB blocks fully covered that have
+ * no cache after the discard so a read of the discarded blocks always returns
+ * the same data. As in the bypass, the caches written back are removed. The
+ * caches not yet written back (and the ones on the RAM buffer) are left as
+ * they are because they are replayed on the next resume and written back
+ * anyway. The blocks keeping the caches split the discard passed down.
+ */
+static int process_discard_bio(struct wb_device *wb, struct bio *bio)
+{
+	struct mutex *lock = NULL;
+	sector_t start = round_up(bi_sector(bio), 1 << 3);
+	sector_t end = round_down(bi_sector(bio) + bio_sectors(bio), 1 << 3);
+	sector_t sector = start, run_start = start;
+	bool split = false;
+	u64 max_id = 0;
+
+	while (sector < end) {
+		struct lookup_result res;
+		bool cached = false;
+
+		prepare_lookup(wb, sector, &res);
+		if (res.lock != lock) {
+			unlock_lookup_head(&lock);
+			lock = res.lock;
+			mutex_lock(lock);
+		}
+		do_cache_lookup(wb, &res);
+		if (res.found) {
+			u64 id = res.found_seg->id;
+
+			if (!res.on_buffer &&
+			    id <= atomic64_read(&wb->last_writeback_segment_id)) {
+				ht_del(wb, res.found_mb);
+				max_id = max(max_id, id);
+			} else
+				cached = true;
+			dec_inflight_ios(wb, res.found_seg);
+		}
+
+		might_cancel_read_cache_cell(wb, sector);
+
+		if (cached) {
+			unlock_lookup_head(&lock);
+			discard_backing_range(wb, run_start, sector, max_id);
+			run_start = sector + (1 << 3);
+			split = true;
+		}
+
+		sector += 1 << 3;
+	}
+	unlock_lookup_head(&lock);
+
+	if (split) {
+		discard_backing_range(wb, run_start, end, max_id);
+		bio_endio_compat(bio, 0);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	if (start >= end ||
+	    !blk_queue_discard(bdev_get_queue(wb->backing_dev->bdev)) ||
+	    might_update_superblock_record(wb, max_id)) {
+		bio_endio_compat(bio, 0);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	bio_remap(bio, wb->backing_dev, start);
+	bi_size(bio) = (end - start) << 9;
+	return DM_MAPIO_REMAPPED;
+}
+
 static int process_write(struct wb_device *wb, struct bio *bio)
 {
-	return wb->write_around_mode ? process_write_wa(wb, bio) : process_write_wb(wb, bio);
+	if (wb->write_around_mode)
+		return process_write_wa(wb, bio);
+
+	if (is_sequential_write(wb, bio))
+		return process_write_bypass(wb, bio);
+
+	return process_write_wb(wb, bio);
 }
 
 struct read_backing_async_context {
@@ -1316,19 +2124,89 @@ static int read_backing_async(struct wb_device *wb, struct bio *bio)
 	return err;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+/*
+ * Process only the first @n sectors of the bio in this map call.
+ * The DM core submits the rest as a new bio.
+ */
+static void accept_partial_bio(struct bio *bio, unsigned n)
+{
+	if (n < bio_sectors(bio))
+		dm_accept_partial_bio(bio, n);
+}
+#else
+/* The DM core splits the bio into 4KB (see init_core_struct) */
+#define accept_partial_bio(bio, n) ASSERT((n) == bio_sectors(bio))
+#endif
+
+/*
+ * Count the sectors from the head of the bio that can be read from the backing
+ * device at once because the blocks following the first one also miss.
+ * @lock is the lock of the lookup head held and is updated as we go.
+ */
+static unsigned count_missed_sectors(struct wb_device *wb, struct bio *bio,
+				     struct mutex **lock)
+{
+	sector_t sector = bi_sector(bio);
+	sector_t end = sector + bio_sectors(bio);
+	sector_t next = calc_cache_alignment(sector) + (1 << 3);
+
+	while (next < end) {
+		struct lookup_result res;
+
+		prepare_lookup(wb, next, &res);
+		if (res.lock != *lock) {
+			unlock_lookup_head(lock);
+			*lock = res.lock;
+			mutex_lock(*lock);
+		}
+		do_cache_lookup(wb, &res);
+		if (res.found) {
+			dec_inflight_ios(wb, res.found_seg);
+			break;
+		}
+		inc_stat(wb, 0, false, false, end - next >= (1 << 3));
+
+		next += (1 << 3);
+	}
+
+	return min(next, end) - sector;
+}
+
 static int process_read(struct wb_device *wb, struct bio *bio)
 {
 	struct lookup_result res;
 	struct dirtiness dirtiness;
 	struct per_bio_data *pbd;
+	struct mutex *lock;
 
 	bool reserved = false;
+	unsigned nr_first = min_t(unsigned, (1 << 3) - bio_calc_offset(bio), bio_sectors(bio));
+
+	/*
+	 * Most of the read hits don't contend with the writes on the lock of
+	 * the lookup head.
+	 */
+	if (cache_lookup_rcu(wb, bio, &res)) {
+		lock = NULL;
+	} else {
+		cache_lookup(wb, bio, &res);
+		lock = res.lock;
+	}
+	inc_stat(wb, 0, res.found, res.on_buffer, nr_first == (1 << 3));
+
+	/*
+	 * A hit is processed block by block. The subsequent misses are read
+	 * from the backing device at once unless we are caching the read data.
+	 */
+	if (res.found || ACCESS_ONCE(wb->read_cache_threshold))
+		accept_partial_bio(bio, nr_first);
+	else
+		accept_partial_bio(bio, count_missed_sectors(wb, bio, &lock));
 
-	mutex_lock(&wb->io_lock);
-	cache_lookup(wb, bio, &res);
 	if (!res.found)
 		reserved = reserve_read_cache_cell(wb, bio);
-	mutex_unlock(&wb->io_lock);
+	unlock_lookup_head(&lock);
 
 	if (!res.found) {
 		if (reserved) {
@@ -1359,7 +2237,7 @@ static int process_read(struct wb_device *wb, struct bio *bio)
 			goto read_buffered_mb_exit;
 
 		if (dirtiness.is_dirty)
-			copy_to_bio_payload(bio, ref_buffered_mb(wb, res.found_mb), dirtiness.data_bits);
+			copy_to_bio_payload(bio, ref_buffered_mb(wb, res.found_seg, res.found_mb), dirtiness.data_bits);
 
 read_buffered_mb_exit:
 		dec_inflight_ios(wb, res.found_seg);
@@ -1408,7 +2286,7 @@ read_mb_exit:
 	pbd->type = PBD_READ_SEG;
 	pbd->seg = res.found_seg;
 
-	bio_remap(bio, wb->cache_dev,
+	bio_remap(bio, res.found_seg->cache_dev,
 		  calc_mb_start_sector(wb, res.found_seg, res.found_mb->idx) +
 		  bio_calc_offset(bio));
 
@@ -1420,6 +2298,115 @@ static int process_bio(struct wb_device *wb, struct bio *bio)
 	return bio_is_write(bio) ? process_write(wb, bio) : process_read(wb, bio);
 }
 
+/*----------------------------------------------------------------------------*/
+
+static void finish_deferred_bio(struct bio *bio, int r)
+{
+	if (r == DM_MAPIO_REMAPPED)
+		generic_make_request(bio);
+	else if (r < 0)
+		bio_endio_compat(bio, r);
+}
+
+static void process_deferred_bios(struct work_struct *work)
+{
+	struct deferred_bios *deferred = container_of(work, struct deferred_bios, work);
+	struct wb_device *wb = deferred->wb;
+	struct log_head *log_head;
+	struct bio_list bios, writes, done, parked;
+	struct bio *bio;
+	unsigned long flags;
+
+	bio_list_init(&bios);
+	bio_list_init(&writes);
+	bio_list_init(&done);
+	bio_list_init(&parked);
+
+	spin_lock_irqsave(&deferred->lock, flags);
+	bio_list_merge(&bios, &deferred->bios);
+	bio_list_init(&deferred->bios);
+	spin_unlock_irqrestore(&deferred->lock, flags);
+
+	/* The writes not to be cached are processed one by one */
+	while ((bio = bio_list_pop(&bios))) {
+		if (wb->write_around_mode)
+			finish_deferred_bio(bio, process_write_wa(wb, bio));
+		else if (is_sequential_write(wb, bio))
+			finish_deferred_bio(bio, process_write_bypass(wb, bio));
+		else
+			bio_list_add(&writes, bio);
+	}
+
+	if (bio_list_empty(&writes))
+		return;
+
+	/* The rest are written on the log head in one hold of the lock */
+	log_head = get_log_head(wb);
+	mutex_lock(&log_head->lock);
+	while ((bio = bio_list_pop(&writes))) {
+		int err = __do_process_write(wb, log_head, bio);
+		if (err == -EINPROGRESS)
+			bio_list_add(&parked, bio);
+		else if (err)
+			bio_endio_compat(bio, err);
+		else
+			bio_list_add(&done, bio);
+	}
+	mutex_unlock(&log_head->lock);
+
+	while ((bio = bio_list_pop(&done)))
+		complete_process_write(wb, bio);
+	while ((bio = bio_list_pop(&parked)))
+		read_old_data_async(wb, bio);
+}
+
+static void defer_write_bio(struct wb_device *wb, struct bio *bio)
+{
+	unsigned long flags;
+	int cpu = get_cpu();
+	struct deferred_bios *deferred = per_cpu_ptr(wb->deferred_bios, cpu);
+
+	spin_lock_irqsave(&deferred->lock, flags);
+	bio_list_add(&deferred->bios, bio);
+	spin_unlock_irqrestore(&deferred->lock, flags);
+
+	queue_work_on(cpu, wb->deferred_wq, &deferred->work);
+	put_cpu();
+}
+
+static int init_deferred_bios(struct wb_device *wb)
+{
+	int cpu;
+
+	wb->deferred_bios = alloc_percpu(struct deferred_bios);
+	if (!wb->deferred_bios)
+		return -ENOMEM;
+
+	wb->deferred_wq = alloc_workqueue("dmwb_deferred", WQ_MEM_RECLAIM, 0);
+	if (!wb->deferred_wq) {
+		free_percpu(wb->deferred_bios);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct deferred_bios *deferred = per_cpu_ptr(wb->deferred_bios, cpu);
+		deferred->wb = wb;
+		spin_lock_init(&deferred->lock);
+		bio_list_init(&deferred->bios);
+		INIT_WORK(&deferred->work, process_deferred_bios);
+	}
+
+	return 0;
+}
+
+static void free_deferred_bios(struct wb_device *wb)
+{
+	destroy_workqueue(wb->deferred_wq); /* This drains wq. So, must precede the others */
+	free_percpu(wb->deferred_bios);
+}
+
+/*----------------------------------------------------------------------------*/
+
 static int process_barrier_bio(struct wb_device *wb, struct bio *bio)
 {
 	/* barrier bio doesn't have data */
@@ -1438,6 +2425,18 @@ static int writeboost_map(struct dm_target *ti, struct bio *bio)
 	if (bio_is_barrier(bio))
 		return process_barrier_bio(wb, bio);
 
+	if (bio_is_discard(bio))
+		return process_discard_bio(wb, bio);
+
+	/*
+	 * The reads are never deferred because they may trim the bio, which
+	 * must be done in the map.
+	 */
+	if (bio_is_write(bio) && ACCESS_ONCE(wb->deferred_write_mode)) {
+		defer_write_bio(wb, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
 	return process_bio(wb, bio);
 }
 
@@ -1458,6 +2457,66 @@ static int writeboost_end_io(struct dm_target *ti, struct bio *bio, int error)
 	}
 }
 
+static void put_cache_devs(struct wb_device *wb)
+{
+	while (wb->nr_cache_devs)
+		dm_put_device(wb->ti, wb->cache_devs[--wb->nr_cache_devs]);
+}
+
+/*
+ * The cache devices are separated by commas. The order matters because the
+ * segments are striped over them in the order.
+ */
+static int consume_cache_devs(struct wb_device *wb, const char *arg)
+{
+	int err = 0;
+	struct dm_target *ti = wb->ti;
+	char *paths, *cur, *path;
+	u32 i;
+
+	if (!arg)
+		return -EINVAL;
+
+	paths = kstrdup(arg, GFP_KERNEL);
+	if (!paths)
+		return -ENOMEM;
+
+	cur = paths;
+	while ((path = strsep(&cur, ","))) {
+		struct dm_dev *dev;
+
+		if (wb->nr_cache_devs == NR_MAX_CACHE_DEVS) {
+			DMERR("Too many cache_devs. max %u", NR_MAX_CACHE_DEVS);
+			err = -EINVAL;
+			goto bad;
+		}
+
+		err = dm_get_device(ti, path, dm_table_get_mode(ti->table), &dev);
+		if (err) {
+			DMERR("Failed to get cache_dev");
+			goto bad;
+		}
+
+		for (i = 0; i < wb->nr_cache_devs; i++) {
+			if (wb->cache_devs[i]->bdev == dev->bdev) {
+				DMERR("cache_dev %s is duplicated", path);
+				dm_put_device(ti, dev);
+				err = -EINVAL;
+				goto bad;
+			}
+		}
+		wb->cache_devs[wb->nr_cache_devs++] = dev;
+	}
+
+	kfree(paths);
+	return err;
+
+bad:
+	put_cache_devs(wb);
+	kfree(paths);
+	return err;
+}
+
 static int consume_essential_argv(struct wb_device *wb, struct dm_arg_set *as)
 {
 	int err = 0;
@@ -1470,12 +2529,9 @@ static int consume_essential_argv(struct wb_device *wb, struct dm_arg_set *as)
 		return err;
 	}
 
-	err = dm_get_device(ti, dm_shift_arg(as), dm_table_get_mode(ti->table),
-			    &wb->cache_dev);
-	if (err) {
-		DMERR("Failed to get cache_dev");
+	err = consume_cache_devs(wb, dm_shift_arg(as));
+	if (err)
 		goto bad_get_cache;
-	}
 
 	return err;
 
@@ -1513,6 +2569,13 @@ static int do_consume_optional_argv(struct wb_device *wb, struct dm_arg_set *as,
 		{0, 127, "Invalid read_cache_threshold"},
 		{0, 1, "Invalid write_around_mode"},
 		{1, 2048, "Invalid nr_read_cache_cells"},
+		{1, NR_MAX_LOG_HEADS, "Invalid nr_log_heads"},
+		{0, 1024, "Invalid write_seq_threshold"},
+		{4, MAX_SEGMENT_SIZE_ORDER, "Invalid segment_size_order"},
+		{1, 256, "Invalid nr_rambuf_pool"},
+		{0, 1, "Invalid deferred_write_mode"},
+		{0, 100000, "Invalid barrier_deadline_us"},
+		{0, 10000, "Invalid idle_flush_ms"},
 	};
 	unsigned tmp;
 
@@ -1529,6 +2592,13 @@ static int do_consume_optional_argv(struct wb_device *wb, struct dm_arg_set *as,
 		consume_kv(read_cache_threshold, 4, false);
 		consume_kv(write_around_mode, 5, true);
 		consume_kv(nr_read_cache_cells, 6, true);
+		consume_kv(nr_log_heads, 7, true);
+		consume_kv(write_seq_threshold, 8, false);
+		consume_kv(segment_size_order, 9, true);
+		consume_kv(nr_rambuf_pool, 10, false);
+		consume_kv(deferred_write_mode, 11, false);
+		consume_kv(barrier_deadline_us, 12, false);
+		consume_kv(idle_flush_ms, 13, false);
 
 		if (!err) {
 			argc--;
@@ -1547,7 +2617,7 @@ static int consume_optional_argv(struct wb_device *wb, struct dm_arg_set *as)
 	struct dm_target *ti = wb->ti;
 
 	static struct dm_arg _args[] = {
-		{0, 14, "Invalid optional argc"},
+		{0, 28, "Invalid optional argc"},
 	};
 	unsigned argc = 0;
 
@@ -1570,25 +2640,26 @@ static int init_core_struct(struct dm_target *ti)
 	int err = 0;
 	struct wb_device *wb;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+	/* We can't trim the bio in .map without dm_accept_partial_bio() */
 	err = dm_set_target_max_io_len(ti, 1 << 3);
 	if (err) {
 		DMERR("Failed to set max_io_len");
 		return err;
 	}
+#endif
 
 	ti->num_flush_bios = 1;
 	ti->flush_supported = true;
 
 	/*
-	 * dm-writeboost does't support TRIM
-	 *
 	 * https://github.com/akiradeveloper/dm-writeboost/issues/110
-	 * - discarding backing data only violates DRAT
-	 * - strictly discarding both cache blocks and backing data is nearly impossible
-	 *   considering cache hits may occur partially.
+	 * The discard is passed down only for the blocks that have no cache
+	 * left so the cached data never hides the discarded backing data
+	 * (see process_discard_bio). The discarded blocks aren't zeroed.
 	 */
-	ti->num_discard_bios = 0;
-	ti->discards_supported = false;
+	ti->num_discard_bios = 1;
+	ti->discards_supported = true;
 
 	ti->PER_BIO_DATA_SIZE = sizeof(struct per_bio_data);
 
@@ -1644,9 +2715,12 @@ static int init_core_struct(struct dm_target *ti)
 		goto bad_io_client;
 	}
 
-	mutex_init(&wb->io_lock);
 	init_waitqueue_head(&wb->inflight_ios_wq);
 	spin_lock_init(&wb->mb_lock);
+	mutex_init(&wb->sb_record_lock);
+	spin_lock_init(&wb->write_seq_lock);
+	wb->write_seq_next_sector = ~0;
+	wb->write_seq_count = 0;
 	atomic64_set(&wb->nr_dirty_caches, 0);
 	clear_bit(WB_CREATED, &wb->flags);
 
@@ -1765,6 +2839,19 @@ static int writeboost_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	save_arg(sync_data_interval);
 	save_arg(read_cache_threshold);
 	save_arg(nr_read_cache_cells);
+	save_arg(nr_log_heads);
+	save_arg(write_seq_threshold);
+	save_arg(segment_size_order);
+	save_arg(nr_rambuf_pool);
+	save_arg(barrier_deadline_us);
+	save_arg(idle_flush_ms);
+
+	wb->nr_log_heads = 1;
+	restore_arg(nr_log_heads);
+	wb->segment_size_order = SEGMENT_SIZE_ORDER;
+	restore_arg(segment_size_order);
+	wb->nr_rambuf_pool = NR_RAMBUF_POOL;
+	restore_arg(nr_rambuf_pool);
 
 	err = resume_cache(wb);
 	if (err) {
@@ -1780,6 +2867,12 @@ static int writeboost_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_read_cache_cells;
 	}
 
+	err = init_deferred_bios(wb);
+	if (err) {
+		ti->error = "init_deferred_bios failed";
+		goto bad_deferred_bios;
+	}
+
 	clear_stat(wb);
 
 	set_bit(WB_CREATED, &wb->flags);
@@ -1789,13 +2882,18 @@ static int writeboost_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	restore_arg(update_sb_record_interval);
 	restore_arg(sync_data_interval);
 	restore_arg(read_cache_threshold);
+	restore_arg(write_seq_threshold);
+	restore_arg(barrier_deadline_us);
+	restore_arg(idle_flush_ms);
 
 	return err;
 
+bad_deferred_bios:
+	free_read_cache_cells(wb);
 bad_read_cache_cells:
 	free_cache(wb);
 bad_resume_cache:
-	dm_put_device(ti, wb->cache_dev);
+	put_cache_devs(wb);
 	dm_put_device(ti, wb->backing_dev);
 bad_optional_argv:
 bad_essential_argv:
@@ -1811,11 +2909,12 @@ static void writeboost_dtr(struct dm_target *ti)
 {
 	struct wb_device *wb = ti->private;
 
+	free_deferred_bios(wb);
 	free_read_cache_cells(wb);
 
 	free_cache(wb);
 
-	dm_put_device(ti, wb->cache_dev);
+	put_cache_devs(wb);
 	dm_put_device(ti, wb->backing_dev);
 
 	free_ctr_args(wb);
@@ -1834,7 +2933,7 @@ static void writeboost_postsuspend(struct dm_target *ti)
 {
 	struct wb_device *wb = ti->private;
 	flush_current_buffer(wb);
-	blkdev_issue_flush(wb->cache_dev->bdev, GFP_NOIO, NULL);
+	flush_cache_devices(wb);
 }
 
 static int writeboost_message(struct dm_target *ti, unsigned argc, char **argv)
@@ -1879,6 +2978,17 @@ static int writeboost_iterate_devices(struct dm_target *ti,
 static void writeboost_io_hints(struct dm_target *ti, struct queue_limits *limits)
 {
 	blk_limits_io_opt(limits, 4096);
+
+	/*
+	 * The discard is processed in the map. Bound the size to bound the
+	 * number of the cache lookups.
+	 */
+	limits->discard_granularity = 4096;
+	limits->max_discard_sectors = 1 << 14;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
+	/* The blocks keeping the caches aren't discarded */
+	limits->discard_zeroes_data = 0;
+#endif
 }
 
 static void writeboost_status(struct dm_target *ti, status_type_t type,
@@ -1893,13 +3003,13 @@ static void writeboost_status(struct dm_target *ti, status_type_t type,
 	case STATUSTYPE_INFO:
 		DMEMIT("%u %u %llu %llu %llu %llu %llu",
 		       (unsigned int)
-		       wb->cursor,
+		       ACCESS_ONCE(wb->log_heads[0].cursor),
 		       (unsigned int)
 		       wb->nr_caches,
 		       (long long unsigned int)
 		       wb->nr_segments,
 		       (long long unsigned int)
-		       wb->current_seg->id,
+		       atomic64_read(&wb->last_allocated_segment_id),
 		       (long long unsigned int)
 		       atomic64_read(&wb->last_flushed_segment_id),
 		       (long long unsigned int)
@@ -1913,7 +3023,7 @@ static void writeboost_status(struct dm_target *ti, status_type_t type,
 		}
 		DMEMIT(" %llu", (unsigned long long) atomic64_read(&wb->count_non_full_flushed));
 
-		DMEMIT(" %d", 10);
+		DMEMIT(" %d", 20);
 		DMEMIT(" writeback_threshold %d",
 		       wb->writeback_threshold);
 		DMEMIT(" nr_cur_batched_writeback %u",
@@ -1924,13 +3034,30 @@ static void writeboost_status(struct dm_target *ti, status_type_t type,
 		       wb->update_sb_record_interval);
 		DMEMIT(" read_cache_threshold %u",
 		       wb->read_cache_threshold);
+		DMEMIT(" write_seq_threshold %u",
+		       wb->write_seq_threshold);
+		DMEMIT(" nr_rambuf_pool %u",
+		       wb->nr_rambuf_pool);
+		DMEMIT(" deferred_write_mode %d",
+		       wb->deferred_write_mode);
+		DMEMIT(" barrier_deadline_us %u",
+		       wb->barrier_deadline_us);
+		DMEMIT(" idle_flush_ms %u",
+		       wb->idle_flush_ms);
+
+		/* Appended after the optional args not to move them */
+		DMEMIT(" %llu %llu",
+		       (unsigned long long) atomic64_read(&wb->count_barrier_commits),
+		       (unsigned long long) atomic64_read(&wb->count_barrier_ios));
 		break;
 
 	case STATUSTYPE_TABLE:
 		format_dev_t(buf, wb->backing_dev->bdev->bd_dev);
 		DMEMIT(" %s", buf);
-		format_dev_t(buf, wb->cache_dev->bdev->bd_dev);
-		DMEMIT(" %s", buf);
+		for (i = 0; i < wb->nr_cache_devs; i++) {
+			format_dev_t(buf, wb->cache_devs[i]->bdev->bd_dev);
+			DMEMIT("%s%s", i ? "," : " ", buf);
+		}
 
 		for (i = 0; i < wb->nr_ctr_args; i++)
 			DMEMIT(" %s", wb->ctr_args[i]);
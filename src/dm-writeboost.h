@@ -25,12 +25,14 @@
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/list.h>
+#include <linux/rculist_nulls.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/mutex.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/workqueue.h>
 #include <linux/crc32c.h>
 #include <linux/device-mapper.h>
@@ -56,8 +58,10 @@
  *
  * ### Segment
  * segment_header_device (512B) +
- * metablock_device * nr_caches_inseg +
+ * metablock_device * nr_caches_inseg + (padded to nr_header_blocks * 4KB)
  * data[0] (4KB) + data[1] + ... + data[nr_cache_inseg - 1]
+ *
+ * The segment size is 1 << segment_size_order sectors.
  */
 
 /*----------------------------------------------------------------------------*/
@@ -71,6 +75,16 @@
 #define WB_MAGIC 0x57427374 /* Magic number "WBst" */
 struct superblock_header_device {
 	__le32 magic;
+	/*
+	 * The older versions didn't zero the rest of the sector so the fields
+	 * below are valid only if the checksum of them is correct.
+	 * Otherwise the default values are used.
+	 */
+	__le32 checksum;
+	__u8 segment_size_order;
+	__u8 nr_cache_devs; /* 0 means 1 */
+	__u8 cache_dev_idx; /* The position in the stripe */
+	__u8 padding[512 - (4 + 4 + 1 + 1 + 1)]; /* 512B */
 } __packed;
 
 /*
@@ -95,6 +109,18 @@ struct metablock_device {
 	__u8 padding[16 - (8 + 1)]; /* 16B */
 } __packed;
 
+/*
+ * A segment can be committed to the cache device incrementally keeping it open
+ * (cf. sync_current_buffer()). Each commit appends a chunk of metablocks with
+ * its own checksum so the committed prefix is valid even if a later commit is
+ * torn.
+ */
+#define NR_MAX_SEG_CHUNKS 32
+struct segment_chunk_device {
+	__le16 length; /* The length of the segment up to this chunk */
+	__le32 checksum; /* Of the metablock_devices and the data in this chunk */
+} __packed;
+
 struct segment_header_device {
 	/*
 	 * We assume 1 sector write is atomic.
@@ -108,9 +134,12 @@ struct segment_header_device {
 	/*
 	 * The number of metablocks in this segment header to be considered in
 	 * log replay.
+	 * This was u8 and the upper byte was padding that's zeroed.
 	 */
-	__u8 length;
-	__u8 padding[512 - (8 + 4 + 1)]; /* 512B */
+	__le16 length;
+	__u8 nr_chunks; /* Zero unless committed incrementally */
+	struct segment_chunk_device chunks[NR_MAX_SEG_CHUNKS];
+	__u8 padding[512 - (8 + 4 + 2 + 1 + 6 * NR_MAX_SEG_CHUNKS)]; /* 512B */
 	/* - TO -------------------------------------- */
 	struct metablock_device mbarr[0]; /* 16B * N */
 } __packed;
@@ -127,22 +156,38 @@ struct metablock {
 
 	u32 idx; /* Const. Index in the metablock array */
 
-	struct hlist_node ht_list; /* Linked to the hash table */
+	struct hlist_nulls_node ht_list; /* Linked to the hash table */
 
 	struct dirtiness dirtiness;
+
+	u16 sorted_idx; /* cf. sort_segment_mbs() */
 };
 
 #define SZ_MAX (~(size_t)0)
 struct segment_header {
 	u64 id; /* Must be initialized to 0 */
 
-	u8 length; /* The number of valid metablocks */
+	u32 length; /* The number of valid metablocks */
 
 	u32 start_idx; /* Const */
 	sector_t start_sector; /* Const */
+	struct dm_dev *cache_dev; /* Const */
 
 	atomic_t nr_inflight_ios;
 
+	bool on_buffer; /* Open on a log head. Writes can overwrite in place */
+	struct rambuffer *rambuf; /* Set while the segment is open or queued */
+
+	/*
+	 * Incremental commit of the open segment. The metablocks before
+	 * nr_frozen can't be overwritten in place because they are (being)
+	 * committed. The flush daemon commits up to commit_length.
+	 */
+	u32 nr_frozen;
+	u32 commit_length;
+	u32 nr_committed; /* Written on the cache device */
+	u32 nr_commits; /* The number of commits requested */
+
 	struct metablock mb_array[0];
 };
 
@@ -152,9 +197,35 @@ struct segment_header {
  * RAM buffer is a buffer that any dirty data are first written into.
  */
 struct rambuffer {
-	struct segment_header *seg;
+	struct wb_device *wb;
+	struct segment_header *seg; /* Set when the segment is queued to flush */
 	void *data;
-	struct bio_list barrier_ios; /* List of deferred bios */
+	struct page_list *pages; /* The pages of data. NULL if not page-aligned */
+	struct list_head list; /* Linked to the free list */
+
+	/* The result of the write to the caching device (cf. flush daemon) */
+	bool write_done;
+	int write_err;
+	u32 nr_batched; /* The segments written in one I/O from this one */
+};
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Log Head
+ * --------
+ * A log head owns at most one open segment and its RAM buffer. Writes are
+ * appended to the log head of the running CPU so that writes on different log
+ * heads don't serialize each other. Segment ids are allocated when a log head
+ * opens a new segment and the flush daemon still flushes the segments in the
+ * order of the id.
+ */
+struct log_head {
+	struct mutex lock;
+	u32 cursor; /* Metablock index to write next */
+	struct segment_header *current_seg; /* NULL if no segment is open */
+	struct rambuffer *current_rambuf;
+	unsigned long last_write; /* jiffies when the last write was appended */
 };
 
 /*----------------------------------------------------------------------------*/
@@ -167,7 +238,11 @@ struct rambuffer {
  * "Batched" means it writes back number of segments at the same time in
  * asynchronous manner.
  * "Sorted" means these writeback IOs are sorted in ascending order of LBA in
- * the backing device. Rb-tree is used to sort the writeback IOs.
+ * the backing device. The metablocks of a segment are sorted when the segment
+ * is flushed and the sorted segments in a batch are merged through a min-heap.
+ * Each batch starts from the sector where the previous one ended and wraps
+ * around (C-SCAN) so the backing device sweeps in one direction. The order of
+ * the segments cleaned isn't changed because a batch is cleaned at once.
  *
  * Reading from the cache device is sequential.
  */
@@ -176,16 +251,28 @@ struct rambuffer {
  * Writeback of a cache line (or metablock)
  */
 struct writeback_io {
-	struct rb_node rb_node;
-
 	sector_t sector; /* Key */
-	u64 id; /* Key */
+	u64 id; /* The segment of the newest data */
 
 	void *data;
 	u8 data_bits;
 };
-#define writeback_io_from_node(node) \
-	rb_entry((node), struct writeback_io, rb_node)
+
+/*
+ * The writeback ios contiguous on the backing device are merged into one I/O.
+ * The data are scattered over the segments so their pages are chained in a
+ * page list. The run starts at an offset in the first page and continues from
+ * the end of a page to the head of the next.
+ */
+#define NR_MAX_WRITEBACK_RUN 64
+struct writeback_run {
+	sector_t sector;
+	unsigned count; /* The number of sectors */
+	unsigned offset; /* The offset in the first page */
+	unsigned end; /* The end offset in the last page */
+	unsigned nr_pages;
+	struct page_list pages[NR_MAX_WRITEBACK_RUN];
+};
 
 /*
  * Writeback of a segment
@@ -194,6 +281,8 @@ struct writeback_segment {
 	struct segment_header *seg; /* Segment to write back */
 	struct writeback_io *ios;
 	void *buf; /* Sequentially read */
+	u32 start; /* The sorted position of the first sector after the sweep */
+	u32 cursor; /* The number of the sorted metablocks merged from start */
 };
 
 /*----------------------------------------------------------------------------*/
@@ -220,11 +309,28 @@ struct read_cache_cells {
 	 * sequence.
 	 */
 	struct rb_root rb_root;
+	spinlock_t lock; /* Protects the cells from the foreground */
 	struct workqueue_struct *wq;
 };
 
 /*----------------------------------------------------------------------------*/
 
+/*
+ * Deferred Write
+ * --------------
+ * In deferred write mode, the write bios are queued to the per-CPU lists and
+ * processed in batch by the worker on the CPU. The submitter never sleeps in
+ * the map and the lock of the log head is taken once per batch.
+ */
+struct deferred_bios {
+	struct wb_device *wb;
+	spinlock_t lock;
+	struct bio_list bios;
+	struct work_struct work;
+};
+
+/*----------------------------------------------------------------------------*/
+
 enum STATFLAG {
 	STAT_WRITE = 3, /* Write or read */
 	STAT_HIT = 2, /* Hit or miss */
@@ -237,8 +343,13 @@ enum WB_FLAG {
 	WB_CREATED = 0,
 };
 
-#define SEGMENT_SIZE_ORDER 10
+#define SEGMENT_SIZE_ORDER 10 /* Default */
+#define MAX_SEGMENT_SIZE_ORDER 13
 #define NR_RAMBUF_POOL 8
+#define RAMBUF_POOL_GROWTH 4
+#define NR_MAX_LOG_HEADS 32
+#define NR_MAX_INFLIGHT_SEGMENTS 8
+#define NR_MAX_CACHE_DEVS 8
 
 /*
  * The context of the cache target instance.
@@ -247,7 +358,12 @@ struct wb_device {
 	struct dm_target *ti;
 
 	struct dm_dev *backing_dev; /* Slow device (HDD) */
-	struct dm_dev *cache_dev; /* Fast device (SSD) */
+	/*
+	 * Fast devices (SSD). The segments are striped over them in
+	 * round-robin and the superblock record is on the first one.
+	 */
+	struct dm_dev *cache_devs[NR_MAX_CACHE_DEVS];
+	u32 nr_cache_devs;
 
 	bool write_around_mode;
 
@@ -255,11 +371,11 @@ struct wb_device {
 	const char **ctr_args;
 
 	bool do_format; /* True if it was the first creation */
-	struct mutex io_lock; /* Mutex is light-weighed */
 
 	/*
 	 * Wq to wait for nr_inflight_ios to be zero.
-	 * nr_inflight_ios of segment header increments inside io_lock.
+	 * nr_inflight_ios of segment header increments inside the lock of the
+	 * hash table head (or the log head that owns the segment).
 	 * While the refcount > 0, the segment can not be overwritten since
 	 * there is at least one bio to direct it.
 	 */
@@ -267,7 +383,10 @@ struct wb_device {
 
 	spinlock_t mb_lock;
 
-	u8 nr_caches_inseg; /* Const */
+	u8 segment_size_order; /* Const */
+	u8 segment_size_order_saved;
+	u32 nr_header_blocks; /* Const. The number of 4KB blocks for the segment header */
+	u32 nr_caches_inseg; /* Const */
 
 	struct kmem_cache *buf_1_cachep;
 	mempool_t *buf_1_pool; /* 1 sector buffer pool */
@@ -278,13 +397,15 @@ struct wb_device {
 
 	/*--------------------------------------------------------------------*/
 
-	/******************
-	 * Current position
-	 ******************/
+	/***********
+	 * Log heads
+	 ***********/
 
-	u32 cursor; /* Metablock index to write next */
-	struct segment_header *current_seg;
-	struct rambuffer *current_rambuf;
+	u32 nr_log_heads; /* Const */
+	u32 nr_log_heads_saved;
+	struct log_head *log_heads;
+
+	atomic64_t last_allocated_segment_id;
 
 	/*--------------------------------------------------------------------*/
 
@@ -306,10 +427,10 @@ struct wb_device {
 	size_t htsize; /* Number of buckets in the hash table */
 
 	/*
-	 * Our hashtable has one special bucket called null head.
-	 * Orphan metablocks are linked to the null head.
+	 * The buckets are protected by a fixed number of mutexes. Orphan
+	 * metablocks aren't linked to any bucket.
 	 */
-	struct ht_head *null_head;
+	struct mutex *ht_locks;
 
 	/*--------------------------------------------------------------------*/
 
@@ -317,8 +438,21 @@ struct wb_device {
 	 * RAM buffer pool
 	 *****************/
 
-	struct rambuffer *rambuf_pool;
+	/*
+	 * The pool keeps nr_rambuf_pool RAM buffers while idle and grows up to
+	 * RAMBUF_POOL_GROWTH times as many on write bursts.
+	 */
+	u32 nr_rambuf_pool; /* Tunable */
+	u32 nr_rambuf_pool_saved;
+	u32 nr_cur_rambuf_pool; /* The number of RAM buffers allocated */
+	spinlock_t rambuf_lock;
+	struct list_head rambuf_free_list;
+	wait_queue_head_t rambuf_wait_queue; /* Wait for a free RAM buffer */
 
+	/*
+	 * Segments can be queued out of order if there are multiple log heads.
+	 * This is the max id queued so far.
+	 */
 	atomic64_t last_queued_segment_id;
 
 	/*--------------------------------------------------------------------*/
@@ -345,6 +479,20 @@ struct wb_device {
 
 	atomic64_t last_flushed_segment_id;
 
+	/*
+	 * The segments up to this id are submitted to the caching device.
+	 * Only the flush daemon touches it.
+	 */
+	u64 last_submitted_segment_id;
+
+	/*
+	 * The open segment is sealed if no write is appended to it for
+	 * $idle_flush_ms so the data on it can be read from the caching
+	 * device. The cache of the caching device isn't flushed.
+	 */
+	u32 idle_flush_ms; /* Tunable */
+	u32 idle_flush_ms_saved;
+
 	/*--------------------------------------------------------------------*/
 
 	/*************************
@@ -357,7 +505,23 @@ struct wb_device {
 	 */
 	struct workqueue_struct *barrier_wq;
 	struct work_struct flush_barrier_work;
+	spinlock_t barrier_lock;
 	struct bio_list barrier_ios; /* List of barrier requests */
+	u64 barrier_id; /* Barriers are acked after this segment is flushed */
+
+	/*
+	 * Group commit. The barriers and FUA writes are committed at latest
+	 * $barrier_deadline_us after the first one arrives.
+	 */
+	u32 barrier_deadline_us; /* Tunable */
+	u32 barrier_deadline_us_saved;
+	struct hrtimer barrier_deadline_timer;
+	bool barrier_deadline_armed; /* Protected by barrier_lock */
+
+	struct work_struct flush_fua_work;
+	struct bio_list fua_ios; /* List of FUA writes. Protected by barrier_lock */
+	u64 fua_id; /* The segments up to this id are written with FUA */
+	atomic64_t last_durable_segment_id; /* No device cache flush needed up to this */
 
 	/*--------------------------------------------------------------------*/
 
@@ -393,11 +557,19 @@ struct wb_device {
 	u32 nr_max_batched_writeback; /* Tunable */
 	u32 nr_max_batched_writeback_saved;
 
-	struct rb_root writeback_tree;
+	struct writeback_segment **writeback_heap; /* nr_writeback_segs entries */
+	sector_t writeback_sweep; /* The sector the next batch starts from */
+	struct writeback_run writeback_run;
 
+	/*
+	 * Twice as many writeback_segs as nr_writeback_segs are allocated.
+	 * The second half holds the segments read ahead for the next batch
+	 * while the current batch is written to the backing device.
+	 */
 	u32 nr_writeback_segs;
 	struct writeback_segment **writeback_segs;
 	u32 nr_cur_batched_writeback; /* Number of segments to be written back */
+	u32 nr_prefetched_writeback; /* Number of segments read ahead */
 	u32 nr_empty_segs;
 
 	/*--------------------------------------------------------------------*/
@@ -420,6 +592,13 @@ struct wb_device {
 	unsigned long update_sb_record_interval; /* Tunable */
 	unsigned long update_sb_record_interval_saved;
 
+	/*
+	 * The last segment id recorded in the superblock.
+	 * The updates are serialized by sb_record_lock.
+	 */
+	struct mutex sb_record_lock;
+	atomic64_t last_recorded_segment_id;
+
 	/*--------------------------------------------------------------------*/
 
 	/*******************
@@ -445,12 +624,36 @@ struct wb_device {
 
 	/*--------------------------------------------------------------------*/
 
+	/*************************
+	 * Sequential Write Bypass
+	 *************************/
+
+	u32 write_seq_threshold; /* Tunable */
+	u32 write_seq_threshold_saved;
+	spinlock_t write_seq_lock;
+	sector_t write_seq_next_sector; /* The sector next to the last write */
+	sector_t write_seq_count; /* In sectors */
+
+	/*--------------------------------------------------------------------*/
+
+	/****************
+	 * Deferred Write
+	 ****************/
+
+	bool deferred_write_mode; /* Tunable */
+	struct deferred_bios __percpu *deferred_bios;
+	struct workqueue_struct *deferred_wq;
+
+	/*--------------------------------------------------------------------*/
+
 	/************
 	 * Statistics
 	 ************/
 
 	atomic64_t stat[STATLEN];
 	atomic64_t count_non_full_flushed;
+	atomic64_t count_barrier_commits;
+	atomic64_t count_barrier_ios; /* Barriers and FUA writes committed */
 
 	/*--------------------------------------------------------------------*/
 
@@ -460,18 +663,22 @@ struct wb_device {
 /*----------------------------------------------------------------------------*/
 
 struct write_io {
-	void *data; /* 4KB */
+	void *data; /* 4KB. NULL if the data isn't staged */
 	u8 data_bits;
 };
 
-void acquire_new_seg(struct wb_device *, u64 id);
-void cursor_init(struct wb_device *);
+void queue_current_buffer(struct wb_device *, struct log_head *);
 void flush_current_buffer(struct wb_device *);
+void sync_current_buffer(struct wb_device *);
+bool needs_fua_seg(struct wb_device *, u64 id);
+void process_deferred_fua_ios(struct wb_device *, u64 flushed_id);
+void flush_fua_ios(struct work_struct *);
 void inc_nr_dirty_caches(struct wb_device *);
 void dec_nr_dirty_caches(struct wb_device *);
 bool mark_clean_mb(struct wb_device *, struct metablock *);
 struct dirtiness read_mb_dirtiness(struct wb_device *, struct segment_header *, struct metablock *);
-int prepare_overwrite(struct wb_device *, struct segment_header *, struct metablock *old_mb, struct write_io *, u8 overwrite_bits);
+void prepare_overwrite(struct wb_device *, struct metablock *old_mb);
+void *read_mb(struct wb_device *, struct segment_header *, struct metablock *, u8 data_bits);
 
 /*----------------------------------------------------------------------------*/
 
@@ -495,6 +702,7 @@ int wb_io_internal(struct wb_device *, struct dm_io_request *,
 			unsigned long *err_bits, bool thread, const char *caller);
 
 sector_t dm_devsize(struct dm_dev *);
+int flush_cache_devices(struct wb_device *);
 
 /*----------------------------------------------------------------------------*/
 
@@ -502,16 +710,20 @@ sector_t dm_devsize(struct dm_dev *);
 #define req_is_write(req) op_is_write((req)->bi_op)
 #define bio_is_barrier(bio) ((bio)->bi_opf & REQ_PREFLUSH)
 #define bio_is_fua(bio) ((bio)->bi_opf & REQ_FUA)
+#define bio_is_discard(bio) (bio_op(bio) == REQ_OP_DISCARD)
 #define WB_IO_WRITE .bi_op = REQ_OP_WRITE, .bi_op_flags = 0
 #define WB_IO_READ .bi_op = REQ_OP_READ, .bi_op_flags = 0
 #define WB_IO_WRITE_FUA .bi_op = REQ_OP_WRITE, .bi_op_flags = REQ_FUA
+#define WB_IO_WRITE_FLUSH_FUA .bi_op = REQ_OP_WRITE, .bi_op_flags = REQ_PREFLUSH | REQ_FUA
 #else
-#define req_is_write(req) ((req)->bi_rw == WRITE)
+#define req_is_write(req) ((req)->bi_rw & WRITE)
 #define bio_is_barrier(bio) ((bio)->bi_rw & REQ_FLUSH)
 #define bio_is_fua(bio) ((bio)->bi_rw & REQ_FUA)
+#define bio_is_discard(bio) ((bio)->bi_rw & REQ_DISCARD)
 #define WB_IO_WRITE .bi_rw = WRITE
 #define WB_IO_READ .bi_rw = READ
 #define WB_IO_WRITE_FUA .bi_rw = WRITE_FUA
+#define WB_IO_WRITE_FLUSH_FUA .bi_rw = WRITE_FLUSH_FUA
 #endif
 
 /*----------------------------------------------------------------------------*/